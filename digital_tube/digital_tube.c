@@ -7,6 +7,9 @@
 #include <linux/delay.h>
 #include <linux/timer.h>
 #include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/slab.h>
 #include <asm/uaccess.h>
 
 /* 这块内存将会被映射到用户空间,一位表示一个点，0表示灭，非0表示亮 */
@@ -28,13 +31,37 @@ struct digital_tube_dev
     struct timer_list timer;
     u8 *row_map;
     u8 *col_map;
-    bool is_mapped;
+    /* 映射计数,第一次映射时开始扫描,最后一个映射解除后停止,由map_lock保护 */
+    struct mutex map_lock;
+    int map_count;
+    /* 设备已移除,gpio已释放,不能再扫描,由map_lock保护 */
+    bool removed;
+    /* 
+     * probe,注册的fb和每个vma各持有一个引用,
+     * remove之后映射可能还在,显存和本结构要等最后一个引用放掉才释放
+     */
+    struct kref ref;
 };
 
 struct digital_tube_dev *d_tube_dev;
 static u8 row_map[8] = {15,10,0,12,7,1,6,3};
 static u8 col_map[8] = {11,5,4,14,2,13,9,8};
 
+/* 
+ * 8位灰度时用8x8 Bayer矩阵做有序抖动,灰度大于(n << 2) + 2的点亮;
+ * 点阵正好8行,左右两半各用一遍矩阵
+ */
+static const u8 bayer8[8][8] = {
+    { 0,32, 8,40, 2,34,10,42},
+    {48,16,56,24,50,18,58,26},
+    {12,44, 4,36,14,46, 6,38},
+    {60,28,52,20,62,30,54,22},
+    { 3,35,11,43, 1,33, 9,41},
+    {51,19,59,27,49,17,57,25},
+    {15,47, 7,39,13,45, 5,37},
+    {63,31,55,23,61,29,53,21},
+};
+
 static void digital_tube_write_short(struct digital_tube_dev *dev,u16 data1,u16 data2)
 {
     struct gpio_desc *shcp = dev->shcp_gpio;
@@ -76,27 +103,34 @@ static void flush_d_tube_fb(struct digital_tube_dev *d_tube)
     u8 *row_map = d_tube->row_map;
     u8 *col_map = d_tube->col_map;
     u8 *mem;
+    bool gray = d_tube->fb_info->var.bits_per_pixel == 8;
+    bool on1,on2;
+    u8 threshold;
     mem = d_tube->fb_info->screen_base;
     
-    // printk("enter:%s\n",__func__);
-    // printk("mem0:%x,mem1:%x,mem2:%x,mem3:%x\n",mem[0],mem[1],mem[2],mem[3]);
-    // printk("mem4:%x,mem5:%x,mem6:%x,mem7:%x\n",mem[4],mem[5],mem[6],mem[7]);
-    // printk("mem8:%x,mem9:%x,mem10:%x,mem11:%x\n",mem[8],mem[9],mem[10],mem[11]);
-    // printk("mem12:%x,mem13:%x,mem14:%x,mem15:%x\n",mem[12],mem[13],mem[14],mem[15]);
-    // for(row = 0 ; row < 8 ; row++){
-    //     data1 = (1u << row_map[row]);
-    //     data2 = (1u << row_map[row]);
-    //     for(col = 0 ; col < 8 ; col++){
-    //         if(!(*(mem + 2 * row) & (1u << col)))
-    //             data1 |= (1u << col_map[col]);
-    //         if(!(*(mem + 2 * row + 1) & (1u << col)))
-    //             data2 |= (1u << col_map[col]);
-    //     }
-    //     digital_tube_write_short(d_tube,data1,data2);
-    //     udelay(10);     //为了提高亮度,延时一会儿
-    // }
+    for(row = 0 ; row < 8 ; row++){
+        data1 = (1u << row_map[row]);
+        data2 = (1u << row_map[row]);
+        for(col = 0 ; col < 8 ; col++){
+            /* 灰度时一行16个字节,抖动和扫描一起做,不用另外转换 */
+            if(gray){
+                threshold = (bayer8[row][col] << 2) + 2;
+                on1 = mem[16 * row + col] > threshold;
+                on2 = mem[16 * row + 8 + col] > threshold;
+            }else{
+                on1 = mem[2 * row] & (1u << col);
+                on2 = mem[2 * row + 1] & (1u << col);
+            }
+            if(!on1)
+                data1 |= (1u << col_map[col]);
+            if(!on2)
+                data2 |= (1u << col_map[col]);
+        }
+        digital_tube_write_short(d_tube,data1,data2);
+        udelay(10);     //为了提高亮度,延时一会儿
+    }
     /* 为保持亮度一致，刷新完一帧后清零 */
-    // digital_tube_write_short(d_tube,0,0);
+    digital_tube_write_short(d_tube,0,0);
 }
 
 
@@ -105,13 +139,7 @@ static void d_tube_timer_func(unsigned long data)
     struct digital_tube_dev *d_tube = (struct digital_tube_dev *)data;
     /* 该函数每20微妙执行一次 */
     unsigned long expire = jiffies + 10;
-    // u8 *mem = d_tube->fb_info->screen_base;
-    u8 *mem = video_mem;
-    // printk("enter:%s\n",__func__);
-    printk("mem0:%x,mem1:%x,mem2:%x,mem3:%x\n",mem[0],mem[1],mem[2],mem[3]);
-    printk("mem4:%x,mem5:%x,mem6:%x,mem7:%x\n",mem[4],mem[5],mem[6],mem[7]);
-    printk("mem8:%x,mem9:%x,mem10:%x,mem11:%x\n",mem[8],mem[9],mem[10],mem[11]);
-    printk("mem12:%x,mem13:%x,mem14:%x,mem15:%x\n",mem[12],mem[13],mem[14],mem[15]);
+
     flush_d_tube_fb(d_tube);
     
     /* 重新开始计时 */
@@ -134,6 +162,39 @@ static int d_tube_fb_release(struct fb_info *info, int user)
     return 0;
 }
 
+/* 分辨率固定为16x8,每点1位(单色)或8位(灰度,扫描时抖动),其他的色深都按单色处理 */
+static int d_tube_fb_check_var(struct fb_var_screeninfo *var, struct fb_info *info)
+{
+    var->xres = var->xres_virtual = 16;
+    var->yres = var->yres_virtual = 8;
+    var->xoffset = var->yoffset = 0;
+    if(var->bits_per_pixel != 8)
+        var->bits_per_pixel = 1;
+    memset(&var->red,0,sizeof(var->red));
+    memset(&var->green,0,sizeof(var->green));
+    memset(&var->blue,0,sizeof(var->blue));
+    memset(&var->transp,0,sizeof(var->transp));
+    if(var->bits_per_pixel == 8)
+        var->red.length = var->green.length = var->blue.length = 8;
+    var->grayscale = var->bits_per_pixel == 8;
+    var->nonstd = 0;
+    return 0;
+}
+
+/* 显存有4k,两种格式都放得下,切换时只改解释方式 */
+static int d_tube_fb_set_par(struct fb_info *info)
+{
+    if(info->var.bits_per_pixel == 8){
+        info->fix.line_length = 16;
+        info->fix.visual = FB_VISUAL_STATIC_PSEUDOCOLOR;
+    }else{
+        info->fix.line_length = 2;
+        info->fix.visual = FB_VISUAL_MONO10;
+    }
+    info->screen_size = info->fix.line_length * info->var.yres;
+    return 0;
+}
+
 static ssize_t d_tube_fb_write(struct fb_info *info, const char __user *buf, size_t count, loff_t *ppos)
 {
     struct digital_tube_dev *d_tube = info->par;
@@ -176,7 +237,7 @@ static ssize_t d_tube_fb_write(struct fb_info *info, const char __user *buf, siz
         (*ppos)+=count;
     
     /* 如果已经映射了内存,则什么也不用做,因为稍后内存会自动同步到oled上的 */
-    if(d_tube->is_mapped){
+    if(d_tube->map_count){
         return err ? err : count;
     }else{  //否则手动刷新缓存
         // flush_d_tube_fb(d_tube);
@@ -184,6 +245,49 @@ static ssize_t d_tube_fb_write(struct fb_info *info, const char __user *buf, siz
     return err ? err : count;
 }
 
+static void d_tube_release(struct kref *ref);
+
+/* 第一个映射建立时开始定时扫描,设备已移除时只计数 */
+static void d_tube_map_get(struct digital_tube_dev *d_tube)
+{
+    kref_get(&d_tube->ref);
+    mutex_lock(&d_tube->map_lock);
+    if(d_tube->map_count++ == 0 && !d_tube->removed)
+        mod_timer(&d_tube->timer,jiffies + 1);
+    mutex_unlock(&d_tube->map_lock);
+}
+
+/* 
+ * 最后一个映射解除时停止扫描,再按最后的内容刷新一帧;
+ * 刷新完会清零,灯全灭,不会停在最后扫描的一行上
+ */
+static void d_tube_map_put(struct digital_tube_dev *d_tube)
+{
+    mutex_lock(&d_tube->map_lock);
+    if(--d_tube->map_count == 0 && !d_tube->removed){
+        del_timer_sync(&d_tube->timer);
+        flush_d_tube_fb(d_tube);
+    }
+    mutex_unlock(&d_tube->map_lock);
+    kref_put(&d_tube->ref,d_tube_release);
+}
+
+/* fork和拆分vma时也会调用open,每个vma对应一次计数 */
+static void d_tube_vm_open(struct vm_area_struct *vma)
+{
+    d_tube_map_get(vma->vm_private_data);
+}
+
+static void d_tube_vm_close(struct vm_area_struct *vma)
+{
+    d_tube_map_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct d_tube_vm_ops = {
+    .open   = d_tube_vm_open,
+    .close  = d_tube_vm_close,
+};
+
 static int d_tube_fb_mmap(struct fb_info *info, struct vm_area_struct *vma)
 {
     struct digital_tube_dev *d_tube = info->par;
@@ -192,10 +296,6 @@ static int d_tube_fb_mmap(struct fb_info *info, struct vm_area_struct *vma)
     unsigned long offset = (vma->vm_pgoff) << PAGE_SHIFT;
     unsigned long page,pos;
 
-    if(d_tube->is_mapped){
-        return 0;
-    }
-
     if(vma->vm_pgoff > (~0UL >> PAGE_SHIFT))
         return -EINVAL;
     if(size > info->fix.smem_len)
@@ -220,19 +320,30 @@ static int d_tube_fb_mmap(struct fb_info *info, struct vm_area_struct *vma)
             size = 0;
     }
 
-    /* 将定时器加入系统开始调度执行 */
-    // d_tube->timer.expires = jiffies + HZ;
-    // add_timer(&d_tube->timer);
-    // d_tube->is_mapped = 1;
+    /* 映射成功后计数,第一个映射会将定时器加入系统开始调度执行 */
+    vma->vm_ops = &d_tube_vm_ops;
+    vma->vm_private_data = d_tube;
+    d_tube_map_get(d_tube);
     return 0;
 }
 
+/* 最后一个打开的文件关闭后由fb核心调用,放掉fb持有的引用 */
+static void d_tube_fb_destroy(struct fb_info *info)
+{
+    struct digital_tube_dev *d_tube = info->par;
+
+    kref_put(&d_tube->ref,d_tube_release);
+}
+
 static struct fb_ops d_tube_fb_ops = {
     .owner      = THIS_MODULE,
     .fb_open    = d_tube_fb_open,
     .fb_release = d_tube_fb_release,
+    .fb_check_var = d_tube_fb_check_var,
+    .fb_set_par = d_tube_fb_set_par,
     .fb_write   = d_tube_fb_write,
     .fb_mmap    = d_tube_fb_mmap,
+    .fb_destroy = d_tube_fb_destroy,
     .fb_copyarea  = cfb_copyarea,
     .fb_fillrect  = cfb_fillrect,
     .fb_imageblit = cfb_imageblit,
@@ -280,6 +391,16 @@ static void rvfree(void *mem,unsigned long size)
     vfree(mem);
 }
 
+static void d_tube_release(struct kref *ref)
+{
+    struct digital_tube_dev *d_tube = container_of(ref,struct digital_tube_dev,ref);
+    struct fb_info *info = d_tube->fb_info;
+
+    rvfree(info->screen_base,info->fix.smem_len);
+    framebuffer_release(info);
+    kfree(d_tube);
+}
+
 static int d_tube_probe(struct platform_device *pdev)
 {   
     int ret = -ENOMEM;
@@ -288,7 +409,8 @@ static int d_tube_probe(struct platform_device *pdev)
     struct fb_info *info;
     
     /* 分配struct digital_tube_dev */
-    d_tube = devm_kzalloc(&pdev->dev,sizeof(struct digital_tube_dev),GFP_KERNEL);
+    /* 映射可能比设备活得久,不能用devm */
+    d_tube = kzalloc(sizeof(struct digital_tube_dev),GFP_KERNEL);
     if(!d_tube){
         dev_err(&pdev->dev,"allocate d_tube_dev failed!\n");
         return ret;
@@ -333,22 +455,18 @@ static int d_tube_probe(struct platform_device *pdev)
     info->fix.line_length = 2;              //一行16个灯,没位对应一个,只需两个字节
     info->fix.visual = FB_VISUAL_MONO10;
 
-    info->var.xres = 16;
-    info->var.yres = 8;
+    info->var.xres = info->var.xres_virtual = 16;
+    info->var.yres = info->var.yres_virtual = 8;
     info->var.bits_per_pixel = 1;
 
     info->screen_base = video_mem;
     info->screen_size = info->fix.line_length * info->var.yres;
     info->fbops = &d_tube_fb_ops;
 
-    /* 注册fb设备 */
-    ret = register_framebuffer(info);
-    if(ret){
-        dev_err(&pdev->dev,"register framebuffer failed!\n");
-        goto release_video_mem;
-    }
-
-    /* 初始化digital_tube_dev的一些其他成员 */
+    /* 
+     * 初始化digital_tube_dev的一些其他成员;
+     * 注册之后马上就可能被映射,定时器要在注册前准备好
+     */
     d_tube->row_map = row_map;
     d_tube->col_map = col_map;
     
@@ -357,7 +475,17 @@ static int d_tube_probe(struct platform_device *pdev)
     init_timer(timer);
     timer->data     = (unsigned long)d_tube;
     timer->function = d_tube_timer_func;
-    
+    mutex_init(&d_tube->map_lock);
+    kref_init(&d_tube->ref);
+
+    /* 注册fb设备,注册成功后fb持有一个引用 */
+    ret = register_framebuffer(info);
+    if(ret){
+        dev_err(&pdev->dev,"register framebuffer failed!\n");
+        goto release_video_mem;
+    }
+    kref_get(&d_tube->ref);
+
     return 0;
 
 release_video_mem:
@@ -373,7 +501,7 @@ put_stcp:
 put_shcp:
     gpiod_put(d_tube->shcp_gpio);
 release_d_tube:
-    devm_kfree(&pdev->dev,d_tube);
+    kfree(d_tube);
     platform_set_drvdata(pdev,NULL);
     return ret;
 }
@@ -387,18 +515,23 @@ static int d_tube_remove(struct platform_device *pdev)
     platform_set_drvdata(pdev,NULL);
     info = d_tube->fb_info;
 
-    rvfree(info->screen_base,info->fix.smem_len);
+    /* 
+     * 先标记移除,之后fork等再映射也不会重新启动定时器;
+     * 定时器会用gpio,停下来之后才能释放gpio
+     */
+    mutex_lock(&d_tube->map_lock);
+    d_tube->removed = true;
+    mutex_unlock(&d_tube->map_lock);
+    del_timer_sync(&d_tube->timer);
     unregister_framebuffer(info);
-    framebuffer_release(info);
 
     gpiod_put(d_tube->shcp_gpio);
     gpiod_put(d_tube->stcp_gpio);
     gpiod_put(d_tube->data1_gpio);
     gpiod_put(d_tube->data2_gpio);
 
-    del_timer(&d_tube->timer);
-
-    devm_kfree(&pdev->dev,d_tube);
+    /* 显存和d_tube等映射和fb都放掉之后在d_tube_release中释放 */
+    kref_put(&d_tube->ref,d_tube_release);
 
     return 0;
 }
@@ -0,0 +1,161 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/string.h>
+#include <asm/unaligned.h>
+#ifdef CONFIG_KERNEL_MODE_NEON
+#include <asm/neon.h>
+#endif
+
+#include "ssd1306_convert.h"
+
+#define BENCH_LINE_BYTES (128 / 8)
+#define BENCH_PAGES (64 / 8)
+#define BENCH_LOOPS (1000)
+
+static bool bench_transpose;
+module_param(bench_transpose,bool,0444);
+MODULE_PARM_DESC(bench_transpose,"benchmark the row-to-page converters at load time");
+
+static bool ssd1306_use_neon;
+
+/* 原来的转换方法:每个输出字节都要把8个源字节各读一遍,移位8次,只用来做自检和比较 */
+static void ssd1306_transpose_ref(const u8 *src,int line_bytes,int byte_start,int byte_end,u8 *out)
+{
+    int j,bits;
+    u8 byte_data;
+
+    for(j = byte_start ; j < byte_end ; j++){
+        for(bits = 0 ; bits < 8 ;bits++){
+            byte_data = 0;
+            byte_data |= ((*(src + 0 * line_bytes + j) << bits) & 0x80) >> 7;
+            byte_data |= ((*(src + 1 * line_bytes + j) << bits) & 0x80) >> 6;
+            byte_data |= ((*(src + 2 * line_bytes + j) << bits) & 0x80) >> 5;
+            byte_data |= ((*(src + 3 * line_bytes + j) << bits) & 0x80) >> 4;
+            byte_data |= ((*(src + 4 * line_bytes + j) << bits) & 0x80) >> 3;
+            byte_data |= ((*(src + 5 * line_bytes + j) << bits) & 0x80) >> 2;
+            byte_data |= ((*(src + 6 * line_bytes + j) << bits) & 0x80) >> 1;
+            byte_data |= ((*(src + 7 * line_bytes + j) << bits) & 0x80) >> 0;
+            out[j * 8 + bits] = byte_data;
+        }
+    }
+}
+
+/* 
+ * 8x8的位矩阵正好是一个64位的字,每个源字节只读一次,用3轮交换完成转置.
+ * 为了照顾32位的arm,64位字拆成高低两个32位寄存器来处理.
+ * 行按倒序装入,这样转置的结果就直接是低位在上的页格式,不需要再做位反转.
+ */
+static void ssd1306_transpose_words(const u8 *src,int line_bytes,int byte_start,int byte_end,u8 *out)
+{
+    u32 x,y,t;
+    int j;
+
+    for(j = byte_start ; j < byte_end ; j++){
+        x = (u32)src[7 * line_bytes + j] << 24 | (u32)src[6 * line_bytes + j] << 16 |
+            (u32)src[5 * line_bytes + j] << 8  | (u32)src[4 * line_bytes + j];
+        y = (u32)src[3 * line_bytes + j] << 24 | (u32)src[2 * line_bytes + j] << 16 |
+            (u32)src[1 * line_bytes + j] << 8  | (u32)src[0 * line_bytes + j];
+
+        t = (x ^ (x >> 7)) & 0x00aa00aa;
+        x = x ^ t ^ (t << 7);
+        t = (y ^ (y >> 7)) & 0x00aa00aa;
+        y = y ^ t ^ (t << 7);
+
+        t = (x ^ (x >> 14)) & 0x0000cccc;
+        x = x ^ t ^ (t << 14);
+        t = (y ^ (y >> 14)) & 0x0000cccc;
+        y = y ^ t ^ (t << 14);
+
+        t = (x & 0xf0f0f0f0) | ((y >> 4) & 0x0f0f0f0f);
+        y = ((x << 4) & 0xf0f0f0f0) | (y & 0x0f0f0f0f);
+        x = t;
+
+        put_unaligned_be32(x,out + j * 8);
+        put_unaligned_be32(y,out + j * 8 + 4);
+    }
+}
+
+void ssd1306_transpose_page(const u8 *src,int line_bytes,int byte_start,int byte_end,u8 *out)
+{
+#ifdef CONFIG_KERNEL_MODE_NEON
+    if(ssd1306_use_neon && byte_end - byte_start >= 16){
+        kernel_neon_begin();
+        byte_start = ssd1306_transpose_neon(src,line_bytes,byte_start,byte_end,out);
+        kernel_neon_end();
+    }
+#endif
+    ssd1306_transpose_words(src,line_bytes,byte_start,byte_end,out);
+}
+
+/* 转换一整帧,用于自检和性能测试 */
+static void ssd1306_transpose_frame(void (*fn)(const u8 *,int,int,int,u8 *),const u8 *src,u8 *out)
+{
+    int page;
+
+    for(page = 0 ; page < BENCH_PAGES ; page++)
+        fn(src + page * 8 * BENCH_LINE_BYTES,BENCH_LINE_BYTES,0,BENCH_LINE_BYTES,
+           out + page * BENCH_LINE_BYTES * 8);
+}
+
+static u64 ssd1306_transpose_time(void (*fn)(const u8 *,int,int,int,u8 *),const u8 *src,u8 *out)
+{
+    u64 start;
+    int i;
+
+    start = ktime_get_ns();
+    for(i = 0 ; i < BENCH_LOOPS ; i++)
+        ssd1306_transpose_frame(fn,src,out);
+    return (ktime_get_ns() - start) / BENCH_LOOPS;
+}
+
+int ssd1306_transpose_init(void)
+{
+    int size = BENCH_LINE_BYTES * BENCH_PAGES * 8;
+    u8 *src,*ref,*out;
+    u32 seed = 0x12345678;
+    int i;
+
+    src = kmalloc(size * 3,GFP_KERNEL);
+    if(!src)
+        return -ENOMEM;
+    ref = src + size;
+    out = ref + size;
+
+    for(i = 0 ; i < size ; i++){
+        seed = seed * 1103515245 + 12345;
+        src[i] = seed >> 16;
+    }
+
+    /* 结果必须与原来的逐位转换完全一致,否则不用它 */
+    ssd1306_transpose_frame(ssd1306_transpose_ref,src,ref);
+    ssd1306_transpose_frame(ssd1306_transpose_words,src,out);
+    if(memcmp(ref,out,size)){
+        pr_err("ssd1306: word transpose self test failed!\n");
+        kfree(src);
+        return -EINVAL;
+    }
+
+#ifdef CONFIG_KERNEL_MODE_NEON
+    if(cpu_has_neon()){
+        memset(out,0,size);
+        ssd1306_use_neon = true;
+        ssd1306_transpose_frame(ssd1306_transpose_page,src,out);
+        if(memcmp(ref,out,size)){
+            pr_err("ssd1306: neon transpose self test failed, not using it\n");
+            ssd1306_use_neon = false;
+        }
+    }
+#endif
+
+    if(bench_transpose){
+        pr_info("ssd1306: transpose ref:   %llu ns/frame\n",ssd1306_transpose_time(ssd1306_transpose_ref,src,out));
+        pr_info("ssd1306: transpose words: %llu ns/frame\n",ssd1306_transpose_time(ssd1306_transpose_words,src,out));
+        if(ssd1306_use_neon)
+            pr_info("ssd1306: transpose neon:  %llu ns/frame\n",ssd1306_transpose_time(ssd1306_transpose_page,src,out));
+    }
+
+    kfree(src);
+    return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef __SSD1306_CONVERT_H
+#define __SSD1306_CONVERT_H
+
+#include <linux/types.h>
+
+/* 
+ * 显存是按行存放的,一个字节对应横向8个点,高位在左;
+ * ssd1306的显存(GDDRAM)按页存放,一个字节对应纵向8个点,低位在上.
+ * 两者之间的转换就是对每个8x8的位矩阵做一次转置.
+ */
+
+/* 
+ * 转换一页(8行):src指向该页第一行,line_bytes为一行的字节数,
+ * 转换[byte_start,byte_end)这些字节,结果写到out[byte * 8]开始的8个字节
+ */
+void ssd1306_transpose_page(const u8 *src,int line_bytes,int byte_start,int byte_end,u8 *out);
+
+/* 自检及(可选的)性能测试,模块加载时调用一次 */
+int ssd1306_transpose_init(void);
+
+#ifdef CONFIG_KERNEL_MODE_NEON
+/* 
+ * 每次处理16个字节,返回处理到的位置,剩下的不足16字节由调用者处理;
+ * ssd1306_neon.c不包含内核头文件,那边用uint8_t另外声明了一份
+ */
+int ssd1306_transpose_neon(const u8 *src,int line_bytes,int byte_start,int byte_end,u8 *out);
+#endif
+
+#endif // !__SSD1306_CONVERT_H
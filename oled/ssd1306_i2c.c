@@ -0,0 +1,413 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/i2c.h>
+#include <linux/of_device.h>
+#include <linux/errno.h>
+#include <linux/fb.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "ssd1306_oled.h"
+
+#define SSD_I2C_MAX_MSGS (32)       /* 分块发送时一次i2c_transfer最多提交的消息数,命令和数据各占一条 */
+#define SSD_I2C_WINDOW_CMD_LEN (7)  /* 控制字节+开窗口的命令,i2c接口的控制器最多6个命令字节 */
+#define SSD_I2C_HEADER_LEN (13)     /* 单次写入时数据前面的部分:6个命令字节各带一个控制字节,再加数据的控制字节 */
+/* 
+ * fair_bus时一次传输最多带的数据字节数,加上地址,命令和控制字节不到80字节,
+ * 400kHz下约1.7ms;整页128字节一次发要3ms以上,等着的传感器还是要等太久
+ */
+#define SSD_I2C_FAIR_WRITE_LEN (64)
+
+/* 按适配器允许的消息数分批提交,失败时重试,消息都是幂等的,重发没有问题 */
+static int ssd1306_i2c_submit(struct ssd1306_dev *ssd1306,struct i2c_msg *msgs,int num)
+{
+    struct i2c_client *client = ssd1306->client;
+    int max = ssd1306->i2c_max_msgs ? : num;
+    int n,ret,retries;
+
+    while(num > 0){
+        n = min(num,max);
+        ret = i2c_transfer(client->adapter,msgs,n);
+        retries = 0;
+        while(ret != n && ++retries < 5){
+            /* 重试计入统计,总线和传感器共用时偶尔失败是正常的,不再每次都打印 */
+            ssd1306->stats.retries++;
+            dev_dbg(&client->dev,"transfer failed! error no is %d,%d times retry\n",ret,retries);
+            ret = i2c_transfer(client->adapter,msgs,n);
+        }
+        if(ret != n){
+            dev_err_ratelimited(&client->dev,"transfer failed after %d retries! error no is %d\n",retries,ret);
+            return ret < 0 ? ret : -EIO;
+        }
+        msgs += n;
+        num -= n;
+    }
+    return 0;
+}
+
+/*
+ * i2c上每次传输的第一个字节是控制字节,0x00表示后面全是命令,0x40表示后面全是数据;
+ * 发送时临时把buf前一个字节换成控制字节,不用再拷贝,发送完再恢复.
+ * 适配器限制了消息长度时分成几次发送,命令流和数据流从哪里断开都可以
+ */
+static int ssd1306_i2c_write(struct ssd1306_dev *ssd1306,u8 control,u8 *buf,int len)
+{
+    struct i2c_msg msg;
+    int max = ssd1306->i2c_max_write ? ssd1306->i2c_max_write - 1 : len;
+    int n,ret = 0;
+    u8 saved;
+
+    while(len > 0){
+        n = min(len,max);
+        saved = buf[-1];
+        buf[-1] = control;
+
+        msg.addr = ssd1306->addr;
+        msg.flags = 0;
+        msg.buf = buf - 1;
+        msg.len = n + 1;
+
+        ret = ssd1306_i2c_submit(ssd1306,&msg,1);
+        buf[-1] = saved;
+        if(ret)
+            break;
+        buf += n;
+        len -= n;
+    }
+    return ret;
+}
+
+static int ssd1306_i2c_write_cmd(struct ssd1306_dev *ssd1306,u8 *buf,int len)
+{
+    return ssd1306_i2c_write(ssd1306,0x00,buf,len);
+}
+
+static int ssd1306_i2c_write_data(struct ssd1306_dev *ssd1306,u8 *buf,int len)
+{
+    return ssd1306_i2c_write(ssd1306,0x40,buf,len);
+}
+
+/* 
+ * 单次写入的头部:每个命令字节前面加控制字节0x80(Co=1,后面只跟一个命令字节),
+ * 最后是0x40(Co=0,D/C#=1),之后直到消息结束都是数据.返回头部的长度
+ */
+static int ssd1306_i2c_header(struct ssd1306_dev *ssd1306,int page_start,int page_end,
+                              int col_start,int col_end,u8 *out)
+{
+    u8 cmd[SSD_WINDOW_CMD_MAX];
+    int i,cmd_len;
+
+    cmd_len = ssd1306->variant->window_cmd(ssd1306,page_start,page_end,col_start,col_end,cmd);
+    for(i = 0 ; i < cmd_len ; i++){
+        out[2 * i] = 0x80;
+        out[2 * i + 1] = cmd[i];
+    }
+    out[2 * cmd_len] = 0x40;
+    return 2 * cmd_len + 1;
+}
+
+/* 
+ * 在暂存区中追加一块:开窗口的命令和窗口中的数据各一条消息,单次写入时合成一条;
+ * 每块都重新开窗口,不依赖屏内地址指针在两次传输之间的状态
+ */
+static void ssd1306_i2c_add_chunk(struct ssd1306_dev *ssd1306,int *num,u8 **stage,int page_start,int page_end,
+                                  int col_start,int col_end,const u8 *data,int len)
+{
+    struct i2c_msg *msgs = ssd1306->i2c_msgs + *num;
+    u8 *p = *stage;
+    int cmd_len;
+
+    if(ssd1306->i2c_single_write){
+        cmd_len = ssd1306_i2c_header(ssd1306,page_start,page_end,col_start,col_end,p);
+        memcpy(p + cmd_len,data,len);
+        msgs[0].addr = ssd1306->addr;
+        msgs[0].flags = 0;
+        msgs[0].buf = p;
+        msgs[0].len = cmd_len + len;
+        *num += 1;
+        *stage = p + cmd_len + len;
+        return;
+    }
+
+    p[0] = 0x00;
+    cmd_len = ssd1306->variant->window_cmd(ssd1306,page_start,page_end,col_start,col_end,p + 1);
+    msgs[0].addr = ssd1306->addr;
+    msgs[0].flags = 0;
+    msgs[0].buf = p;
+    msgs[0].len = cmd_len + 1;
+    p += cmd_len + 1;
+
+    p[0] = 0x40;
+    memcpy(p + 1,data,len);
+    msgs[1].addr = ssd1306->addr;
+    msgs[1].flags = 0;
+    msgs[1].buf = p;
+    msgs[1].len = len + 1;
+    p += len + 1;
+
+    *num += 2;
+    *stage = p;
+}
+
+/* 
+ * 开窗口并写入数据.适配器没有限制时窗口命令和数据在同一次传输中发出,数据直接从发送缓冲区发送;
+ * 限制了一条消息的长度时把窗口切成若干个不超过限制的小窗口,拷贝到暂存区后
+ * 尽量放在一次i2c_transfer中提交.fair_bus时消息长度再限制在SSD_I2C_FAIR_WRITE_LEN以内,
+ * 每块单独提交,块与块之间让出总线.
+ * 单次写入时头部临时写在数据前面,发送缓冲区中整帧前面留够了空间,发完再恢复
+ */
+static int ssd1306_i2c_write_window(struct ssd1306_dev *ssd1306,int page_start,int page_end,
+                                    int col_start,int col_end,u8 *buf,int len)
+{
+    struct i2c_msg *msgs = ssd1306->i2c_msgs;
+    int width = col_end - col_start;
+    int max_write = ssd1306->i2c_max_write;
+    bool fair = ssd1306->fair_bus;     /* 只读一次,中途被sysfs改掉时暂存区的用法不能变 */
+    int cap;
+    int page,col,n,num = 0;
+    u8 *cmd = ssd1306->cmd_buf;
+    u8 *stage = ssd1306->i2c_stage;
+    u8 header[SSD_FRAME_HEADROOM],saved_header[SSD_FRAME_HEADROOM];
+    int header_len;
+    int ret;
+    u8 saved;
+
+    if(fair && (!max_write || max_write > SSD_I2C_FAIR_WRITE_LEN))
+        max_write = SSD_I2C_FAIR_WRITE_LEN;
+    cap = max_write - 1;
+
+    if(ssd1306->i2c_single_write){
+        header_len = ssd1306_i2c_header(ssd1306,page_start,page_end,col_start,col_end,header);
+        cap = max_write - header_len;
+        if(!max_write || len <= cap){
+            memcpy(saved_header,buf - header_len,header_len);
+            memcpy(buf - header_len,header,header_len);
+            msgs[0].addr = ssd1306->addr;
+            msgs[0].flags = 0;
+            msgs[0].buf = buf - header_len;
+            msgs[0].len = header_len + len;
+            ret = ssd1306_i2c_submit(ssd1306,msgs,1);
+            memcpy(buf - header_len,saved_header,header_len);
+            return ret;
+        }
+    }else if(!max_write || len + 1 <= max_write){
+        cmd[0] = 0x00;
+        msgs[0].len = ssd1306->variant->window_cmd(ssd1306,page_start,page_end,col_start,col_end,cmd + 1) + 1;
+        msgs[0].addr = ssd1306->addr;
+        msgs[0].flags = 0;
+        msgs[0].buf = cmd;
+
+        saved = buf[-1];
+        buf[-1] = 0x40;
+        msgs[1].addr = ssd1306->addr;
+        msgs[1].flags = 0;
+        msgs[1].buf = buf - 1;
+        msgs[1].len = len + 1;
+        ret = ssd1306_i2c_submit(ssd1306,msgs,2);
+        buf[-1] = saved;
+        return ret;
+    }
+
+    if(width <= cap){
+        /* 一块可以放下整行,按行切,每块尽量多放几行 */
+        for(page = page_start ; page <= page_end ; page += n){
+            n = min(cap / width,page_end - page + 1);
+            ssd1306_i2c_add_chunk(ssd1306,&num,&stage,page,page + n - 1,col_start,col_end,
+                                  buf + (page - page_start) * width,n * width);
+            if(num == SSD_I2C_MAX_MSGS || fair){
+                ret = ssd1306_i2c_submit(ssd1306,msgs,num);
+                if(ret)
+                    return ret;
+                num = 0;
+                stage = ssd1306->i2c_stage;
+            }
+        }
+    }else{
+        /* 一行都放不下,每行再按列切 */
+        for(page = page_start ; page <= page_end ; page++){
+            for(col = col_start ; col < col_end ; col += n){
+                n = min(cap,col_end - col);
+                ssd1306_i2c_add_chunk(ssd1306,&num,&stage,page,page,col,col + n,
+                                      buf + (page - page_start) * width + col - col_start,n);
+                if(num == SSD_I2C_MAX_MSGS || fair){
+                    ret = ssd1306_i2c_submit(ssd1306,msgs,num);
+                    if(ret)
+                        return ret;
+                    num = 0;
+                    stage = ssd1306->i2c_stage;
+                }
+            }
+        }
+    }
+    if(num)
+        return ssd1306_i2c_submit(ssd1306,msgs,num);
+    return 0;
+}
+
+/* 
+ * 记下适配器的限制,并分配消息数组和暂存区;
+ * 暂存区能放下一批SSD_I2C_MAX_MSGS / 2块,每块是开窗口的命令加上最多max_write_len字节的数据,
+ * 单次写入时一块一条消息,一批最多SSD_I2C_MAX_MSGS块.
+ * 适配器没有限制时只有fair_bus会分块,每块单独提交,暂存区放下一块就够了.
+ *
+ * 单次写入时每个命令字节多一个控制字节,只省掉重复起始和一个地址字节,
+ * 适配器能把两条消息放在一次传输中时并不划算;一次只能传一条消息时两条消息之间有STOP,
+ * 还要多一次i2c_transfer,这时默认打开.设备树中的single-write可以强制打开
+ */
+static int ssd1306_i2c_setup_quirks(struct ssd1306_dev *ssd1306)
+{
+    const struct i2c_adapter_quirks *quirks = ssd1306->client->adapter->quirks;
+    struct device *dev = ssd1306->dev;
+    int chunks;
+
+    ssd1306->i2c_msgs = devm_kcalloc(dev,SSD_I2C_MAX_MSGS,sizeof(struct i2c_msg),GFP_KERNEL);
+    if(!ssd1306->i2c_msgs)
+        return -ENOMEM;
+    ssd1306->i2c_single_write = of_property_read_bool(dev->of_node,"single-write");
+    if(!quirks || !quirks->max_write_len){
+        ssd1306->i2c_stage = devm_kmalloc(dev,SSD_I2C_HEADER_LEN + SSD_I2C_FAIR_WRITE_LEN,GFP_KERNEL);
+        if(!ssd1306->i2c_stage)
+            return -ENOMEM;
+    }
+    if(!quirks)
+        return 0;
+
+    if(quirks->max_num_msgs > 0)
+        ssd1306->i2c_max_msgs = quirks->max_num_msgs;
+    if(quirks->max_num_msgs == 1)
+        ssd1306->i2c_single_write = true;
+    if(quirks->max_write_len){
+        if(quirks->max_write_len <= SSD_I2C_WINDOW_CMD_LEN){
+            dev_err(dev,"adapter max_write_len %u is too small\n",quirks->max_write_len);
+            return -EINVAL;
+        }
+        /* 一条消息除去头部后放不下多少数据时,还是分两条消息发 */
+        if(quirks->max_write_len <= 2 * SSD_I2C_HEADER_LEN)
+            ssd1306->i2c_single_write = false;
+        ssd1306->i2c_max_write = quirks->max_write_len;
+        chunks = ssd1306->i2c_single_write ? SSD_I2C_MAX_MSGS : SSD_I2C_MAX_MSGS / 2;
+        ssd1306->i2c_stage = devm_kmalloc(dev,chunks * (SSD_I2C_HEADER_LEN + quirks->max_write_len),
+                                          GFP_KERNEL);
+        if(!ssd1306->i2c_stage)
+            return -ENOMEM;
+        dev_info(dev,"adapter limits writes to %u bytes, frames are sent in chunks\n",quirks->max_write_len);
+    }
+    return 0;
+}
+
+/*
+ * 设备树中写的地址没有应答时再试一下另一个地址(SA0的接法不同),
+ * 找到之后记下来,以后不再尝试
+ */
+static int ssd1306_i2c_hw_init(struct ssd1306_dev *ssd1306)
+{
+    struct i2c_client *client = ssd1306->client;
+    int ret;
+
+    ssd1306->addr = client->addr;
+    ret = ssd1306_dev_init(ssd1306);
+    if(ret && (client->addr == 0x3c || client->addr == 0x3d)){
+        ssd1306->addr = client->addr ^ 0x01;
+        ret = ssd1306_dev_init(ssd1306);
+    }
+    if(ret){
+        dev_err(&client->dev,"no response at 0x%02x or 0x%02x\n",client->addr,ssd1306->addr);
+        ssd1306->addr = client->addr;
+    }
+    return ret;
+}
+
+static const struct ssd1306_ops ssd1306_i2c_ops = {
+    .hw_init        = ssd1306_i2c_hw_init,
+    .write_cmd      = ssd1306_i2c_write_cmd,
+    .write_data     = ssd1306_i2c_write_data,
+    .write_window   = ssd1306_i2c_write_window,
+};
+
+/* SSD1322没有i2c接口,不在这里 */
+static const struct of_device_id ssd1306_i2c_of_match_table[] = {
+    {
+        .compatible = "ssd1306",
+        .data = &ssd1306_variants[SSD1306_TYPE_SSD1306],
+    },
+    {
+        .compatible = "ssd1309",
+        .data = &ssd1306_variants[SSD1306_TYPE_SSD1309],
+    },
+    {
+        .compatible = "sh1106",
+        .data = &ssd1306_variants[SSD1306_TYPE_SH1106],
+    },
+    {}
+};
+
+static int ssd1306_i2c_probe(struct i2c_client *client,const struct i2c_device_id *id)
+{
+    const struct ssd1306_variant *variant = &ssd1306_variants[SSD1306_TYPE_SSD1306];
+    const struct of_device_id *match;
+    struct ssd1306_dev *ssd1306;
+    int ret;
+
+    /* 设备树匹配时以compatible为准 */
+    match = of_match_device(ssd1306_i2c_of_match_table,&client->dev);
+    if(match)
+        variant = match->data;
+    else if(id)
+        variant = &ssd1306_variants[id->driver_data];
+
+    ssd1306 = ssd1306_core_alloc(&client->dev,&ssd1306_i2c_ops,variant);
+    if(!ssd1306)
+        return -ENOMEM;
+    ssd1306->client = client;
+    i2c_set_clientdata(client,ssd1306);
+
+    ret = ssd1306_i2c_setup_quirks(ssd1306);
+    if(ret){
+        framebuffer_release(ssd1306->info);
+        return ret;
+    }
+
+    ret = ssd1306_core_probe(ssd1306);
+    if(ret)
+        return ret;
+
+    /* 拼接屏的成员没有注册framebuffer,没有fb编号 */
+    if(ssd1306->tile_member)
+        dev_info(&client->dev,"tile member: %s at 0x%02x\n",variant->name,ssd1306->addr);
+    else
+        dev_info(&client->dev,"fb%d: %s at 0x%02x\n",ssd1306->info->node,variant->name,ssd1306->addr);
+    return 0;
+}
+
+static int ssd1306_i2c_remove(struct i2c_client *client)
+{
+    return ssd1306_core_remove(i2c_get_clientdata(client));
+}
+
+static const struct i2c_device_id ssd1306_i2c_id_table[] = {
+    {"ssd1306",SSD1306_TYPE_SSD1306},
+    {"ssd1309",SSD1306_TYPE_SSD1309},
+    {"sh1106",SSD1306_TYPE_SH1106},
+    {}
+};
+
+static struct i2c_driver ssd1306_i2c_driver = {
+    .driver = {
+        .name = "ssd1306_i2c_driver",
+        .of_match_table = ssd1306_i2c_of_match_table,
+        .owner = THIS_MODULE,
+    },
+    .probe = ssd1306_i2c_probe,
+    .remove = ssd1306_i2c_remove,
+    .id_table = ssd1306_i2c_id_table,
+};
+
+int ssd1306_i2c_register(void)
+{
+    return i2c_add_driver(&ssd1306_i2c_driver);
+}
+
+void ssd1306_i2c_unregister(void)
+{
+    i2c_del_driver(&ssd1306_i2c_driver);
+}
@@ -0,0 +1,74 @@
+#include <arm_neon.h>
+
+/* 
+ * 这里只能用编译器的头文件,与lib/raid6/neon*.c一样:arm_neon.h带进来的stdint.h
+ * 与内核的linux/types.h对uintptr_t等类型的定义不同,所以不包含ssd1306_convert.h,
+ * 原型单独写一份,u8换成uint8_t,两边要保持一致
+ */
+int ssd1306_transpose_neon(const uint8_t *src,int line_bytes,int byte_start,int byte_end,uint8_t *out);
+
+/* 
+ * 交换a中第shift位起的位和b中对应的位,即8x8位矩阵转置中的一轮
+ * 16个通道同时处理,每个通道是一列字节
+ */
+#define SWAP_BITS(a,b,mask,shift)                                   \
+do{                                                                 \
+    uint8x16_t __t;                                                 \
+    __t = vandq_u8(veorq_u8(a,vshrq_n_u8(b,shift)),vdupq_n_u8(mask)); \
+    a = veorq_u8(a,__t);                                            \
+    b = veorq_u8(b,vshlq_n_u8(__t,shift));                          \
+}while(0)
+
+int ssd1306_transpose_neon(const uint8_t *src,int line_bytes,int byte_start,int byte_end,uint8_t *out)
+{
+    uint8x16_t r0,r1,r2,r3,r4,r5,r6,r7;
+    uint8x16x2_t z01,z23,z45,z67;
+    uint16x8x4_t lo,hi;
+    int j;
+
+    for(j = byte_start ; j + 16 <= byte_end ; j += 16){
+        /* 与ssd1306_transpose_words一样按倒序装入各行 */
+        r0 = vld1q_u8(src + 7 * line_bytes + j);
+        r1 = vld1q_u8(src + 6 * line_bytes + j);
+        r2 = vld1q_u8(src + 5 * line_bytes + j);
+        r3 = vld1q_u8(src + 4 * line_bytes + j);
+        r4 = vld1q_u8(src + 3 * line_bytes + j);
+        r5 = vld1q_u8(src + 2 * line_bytes + j);
+        r6 = vld1q_u8(src + 1 * line_bytes + j);
+        r7 = vld1q_u8(src + 0 * line_bytes + j);
+
+        SWAP_BITS(r0,r4,0x0f,4);
+        SWAP_BITS(r1,r5,0x0f,4);
+        SWAP_BITS(r2,r6,0x0f,4);
+        SWAP_BITS(r3,r7,0x0f,4);
+
+        SWAP_BITS(r0,r2,0x33,2);
+        SWAP_BITS(r1,r3,0x33,2);
+        SWAP_BITS(r4,r6,0x33,2);
+        SWAP_BITS(r5,r7,0x33,2);
+
+        SWAP_BITS(r0,r1,0x55,1);
+        SWAP_BITS(r2,r3,0x55,1);
+        SWAP_BITS(r4,r5,0x55,1);
+        SWAP_BITS(r6,r7,0x55,1);
+
+        /* rk的第n个通道是第j+n列的第k个输出字节,交织后按列顺序存放 */
+        z01 = vzipq_u8(r0,r1);
+        z23 = vzipq_u8(r2,r3);
+        z45 = vzipq_u8(r4,r5);
+        z67 = vzipq_u8(r6,r7);
+
+        lo.val[0] = vreinterpretq_u16_u8(z01.val[0]);
+        lo.val[1] = vreinterpretq_u16_u8(z23.val[0]);
+        lo.val[2] = vreinterpretq_u16_u8(z45.val[0]);
+        lo.val[3] = vreinterpretq_u16_u8(z67.val[0]);
+        hi.val[0] = vreinterpretq_u16_u8(z01.val[1]);
+        hi.val[1] = vreinterpretq_u16_u8(z23.val[1]);
+        hi.val[2] = vreinterpretq_u16_u8(z45.val[1]);
+        hi.val[3] = vreinterpretq_u16_u8(z67.val[1]);
+
+        vst4q_u16((uint16_t *)(out + j * 8),lo);
+        vst4q_u16((uint16_t *)(out + j * 8 + 64),hi);
+    }
+    return j;
+}
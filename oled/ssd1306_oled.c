@@ -1,308 +1,1090 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
-#include <linux/i2c.h>
-#include <linux/gpio/consumer.h>
 #include <linux/delay.h>
 #include <linux/fb.h>
 #include <linux/mm.h>
 #include <linux/vmalloc.h>
 #include <linux/errno.h>
+#include <linux/of.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/log2.h>
+#include <linux/bitrev.h>
+#include <linux/jhash.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <asm/uaccess.h>
 
 #include "ssd1306_oled.h"
+#include "ssd1306_convert.h"
+
+#define SSD_MAX_BACKOFF (16)        /* 内容一直不变时刷新间隔最多放大到的倍数 */
+#define SSD_CONVERT_RETRIES (3)     /* 转换时显存被改过,最多重新转换的次数,之后持锁转换 */
+
+/* 
+ * 各控制器默认的初始化序列,一次传输全部发出去;
+ * 不同的屏可以在设备树中用init-seq属性(/bits/ 8 <...>)给出自己的序列
+ */
+static const u8 ssd1306_init_seq[] = {
+    CMD_SET_ADDR_MODE,0x00,             /* 水平地址模式 */
+    CMD_SET_COL_ADDR,0,0x7f,
+    CMD_SET_PAGE_ADDR,0,0x07,
+    0x40,                               /* 起始行0 */
+    CMD_SET_CONTRAST_CONTROL,0xff,
+    0xa1,                               /* 列地址127映射到SEG0 */
+    0xa6,                               /* 正常显示,不反色 */
+    0xa8,0x3f,                          /* 64路复用 */
+    0xc8,                               /* COM倒序扫描 */
+    0xd3,0x00,                          /* 显示偏移 */
+    0xd5,0x80,                          /* 时钟分频 */
+    0xd8,0x05,
+    0xd9,0xf1,                          /* 预充电周期 */
+    0xda,0x12,                          /* COM引脚配置 */
+    0xdb,0x30,                          /* VCOMH */
+    0x8d,0x14,                          /* 打开电荷泵 */
+    0xaf,                               /* 开显示 */
+};
 
-#define VIDEOMEMSIZE (4 * 1024)     /* 4k,因为一页最小,反正最后会被延长到4k */
-#define SSD_FLUSH_INTERVAL (10)     /* 将内容刷新到屏幕上的时间间隔，单位：ms */
+/* SSD1309与SSD1306命令兼容,但没有电荷泵,VCC由外部提供 */
+static const u8 ssd1309_init_seq[] = {
+    0xae,                               /* 关显示 */
+    0xd5,0xa0,                          /* 时钟分频 */
+    0xa8,0x3f,                          /* 64路复用 */
+    0xd3,0x00,                          /* 显示偏移 */
+    0x40,                               /* 起始行0 */
+    CMD_SET_ADDR_MODE,0x00,             /* 水平地址模式 */
+    0xa1,                               /* 列地址127映射到SEG0 */
+    0xc8,                               /* COM倒序扫描 */
+    0xda,0x12,                          /* COM引脚配置 */
+    CMD_SET_CONTRAST_CONTROL,0xbf,
+    0xd9,0x25,                          /* 预充电周期 */
+    0xdb,0x34,                          /* VCOMH */
+    0xa4,                               /* 按显存显示 */
+    0xa6,                               /* 正常显示,不反色 */
+    0xaf,                               /* 开显示 */
+};
 
-static void *video_mem;
-static u_long video_mem_size = VIDEOMEMSIZE;
+/* SH1106只有页地址模式,没有0x20~0x22命令,用的是内置的DC-DC */
+static const u8 sh1106_init_seq[] = {
+    0xae,                               /* 关显示 */
+    0xd5,0x80,                          /* 时钟分频 */
+    0xa8,0x3f,                          /* 64路复用 */
+    0xd3,0x00,                          /* 显示偏移 */
+    0x40,                               /* 起始行0 */
+    0xad,0x8b,                          /* 打开DC-DC */
+    0xa1,                               /* 列地址反向 */
+    0xc8,                               /* COM倒序扫描 */
+    0xda,0x12,                          /* COM引脚配置 */
+    CMD_SET_CONTRAST_CONTROL,0xff,
+    0xd9,0x1f,                          /* 预充电周期 */
+    0xdb,0x40,                          /* VCOMH */
+    0x33,                               /* 电荷泵电压9V */
+    0xa6,                               /* 正常显示,不反色 */
+    0xaf,                               /* 开显示 */
+};
 
-struct ssd1306_dev
-{
-    struct fb_info *info;
-    struct i2c_client *client;
-    struct timer_list timer;
-    struct work_struct work;
-    struct workqueue_struct *wqueue;
-    bool is_mapped;
+/* SSD1322的参数按数据发送,序列按{命令,参数个数,参数...}编码 */
+static const u8 ssd1322_init_seq[] = {
+    0xfd,1,0x12,                        /* 解锁命令 */
+    0xae,0,                             /* 关显示 */
+    0xb3,1,0x91,                        /* 时钟分频 */
+    0xca,1,0x3f,                        /* 64路复用 */
+    0xa2,1,0x00,                        /* 显示偏移 */
+    0xa1,1,0x00,                        /* 起始行0 */
+    0xa0,2,0x14,0x11,                   /* 水平递增,半字节重映射,COM倒序扫描,双COM */
+    0xb5,1,0x00,                        /* 关闭GPIO */
+    0xab,1,0x01,                        /* 使用内部VDD */
+    0xb4,2,0xa0,0xfd,                   /* 外部VSL,提高灰度显示质量 */
+    0xc1,1,0x9f,                        /* 对比度 */
+    0xc7,1,0x0f,                        /* 主对比度 */
+    0xb9,0,                             /* 线性灰度表 */
+    0xb1,1,0xe2,                        /* 相位长度 */
+    0xd1,2,0x82,0x20,
+    0xbb,1,0x1f,                        /* 预充电电压 */
+    0xb6,1,0x08,                        /* 第二预充电周期 */
+    0xbe,1,0x07,                        /* VCOMH */
+    0xa6,0,                             /* 正常显示 */
+    0xa9,0,                             /* 退出局部显示 */
+    0xaf,0,                             /* 开显示 */
+};
+
+/* 旋转180度:列地址0映射到SEG0,COM正序扫描,与上面默认的方向正好相反 */
+static const u8 ssd1306_flip_seq[] = {
+    0xa0,
+    0xc0,
 };
 
-static struct ssd1306_dev ssd1306_dev;
+/* SSD1322同时反转列地址,列内4个点的顺序和COM扫描方向 */
+static const u8 ssd1322_flip_seq[] = {
+    0xa0,2,0x02,0x11,
+};
 
-static void *rvmalloc(unsigned long size)
+static struct dentry *ssd1306_debugfs_root;
+
+static unsigned int max_fps = SSD_DEFAULT_FPS;
+module_param(max_fps,uint,0444);
+MODULE_PARM_DESC(max_fps,"default upper limit of the flush rate, can be changed through sysfs");
+
+/* 
+ * 写入数据,buf必须位于发送缓冲区中,并且前面至少留有SSD_TX_HEADROOM个字节,
+ * 具体怎么发由总线决定,调用者需持有io_lock
+ */
+static int ssd1306_write_data(struct ssd1306_dev *ssd1306,u8 *buf,int len)
 {
-    void *mem;
-    unsigned long addr;
-    
-    size = PAGE_ALIGN(size);
-    mem = vmalloc(size);
-    if(!mem){
-        return NULL;
+    return ssd1306->ops->write_data(ssd1306,buf,len);
+}
+
+/* 
+ * 写入命令,命令先拷贝到预先分配好的cmd_buf中,多条命令可以在一次传输中连续发送,
+ * 调用者需持有io_lock
+ */
+static int ssd1306_write_cmd(struct ssd1306_dev *ssd1306,const u8 *buf,int len)
+{
+    if(len > SSD_CMD_BUF_SIZE - SSD_TX_HEADROOM)
+        return -EINVAL;
+    memcpy(ssd1306->cmd_buf + SSD_TX_HEADROOM,buf,len);
+    return ssd1306->ops->write_cmd(ssd1306,ssd1306->cmd_buf + SSD_TX_HEADROOM,len);
+}
+
+/* 
+ * 发送一个命令序列,一般作为一次命令传输;
+ * 参数要按数据发送的控制器,逐条发送命令和它的参数,调用者需持有io_lock
+ */
+static int ssd1306_write_cmd_seq(struct ssd1306_dev *ssd1306,const u8 *seq,int len)
+{
+    u8 *args = ssd1306->cmd_buf + SSD_TX_HEADROOM;
+    int i,n,ret;
+
+    if(!ssd1306->variant->args_as_data)
+        return ssd1306_write_cmd(ssd1306,seq,len);
+
+    for(i = 0 ; i + 2 <= len ; i += 2 + n){
+        n = seq[i + 1];
+        if(i + 2 + n > len || n > SSD_CMD_BUF_SIZE - SSD_TX_HEADROOM)
+            return -EINVAL;
+        ret = ssd1306_write_cmd(ssd1306,&seq[i],1);
+        if(ret)
+            return ret;
+        if(!n)
+            continue;
+        memcpy(args,&seq[i + 2],n);
+        ret = ssd1306_write_data(ssd1306,args,n);
+        if(ret)
+            return ret;
     }
+    return 0;
+}
+
+/* 整个初始化序列作为一次命令传输发送,总线的hw_init也可以调用 */
+int ssd1306_dev_init(struct ssd1306_dev *ssd1306)
+{
+    int ret;
     
-    memset(mem,0,size);     //防止数据泄露到用户空间
-    
-    addr = (unsigned long)mem;
-    
-    while((long)size > 0){
-        SetPageReserved(vmalloc_to_page((void *)addr));
-        addr += PAGE_SIZE;
-        size -= PAGE_SIZE;
-    }
+    mutex_lock(&ssd1306->io_lock);
+    ret = ssd1306_write_cmd_seq(ssd1306,ssd1306->init_seq,ssd1306->init_seq_len);
+    /* 旋转180度不用软件转换,由控制器反过来扫描 */
+    if(!ret && ssd1306->rotate == 180)
+        ret = ssd1306_write_cmd_seq(ssd1306,ssd1306->variant->flip_seq,ssd1306->variant->flip_seq_len);
+    mutex_unlock(&ssd1306->io_lock);
+    return ret;
+}
 
-    return mem;
+static int ssd1306_dev_exit(struct ssd1306_dev *ssd1306)
+{
+    mutex_lock(&ssd1306->io_lock);
+    ssd1306_write_cmd(ssd1306,"\xae",1);
+    mutex_unlock(&ssd1306->io_lock);
+    return 0;
 }
 
-static void rvfree(void *mem,unsigned long size)
+/* 
+ * 内核中修改显存的地方(write,fbcon)都放在写区间中,写区间很短,只有内存拷贝和cfb画图,
+ * 不会等总线;刷新转换时用序号检查转换过程中显存有没有被改过
+ */
+static void ssd1306_smem_write_begin(struct ssd1306_dev *ssd1306,unsigned long *flags)
 {
-    unsigned long addr;
+    spin_lock_irqsave(&ssd1306->lock,*flags);
+    write_seqcount_begin(&ssd1306->smem_seq);
+}
 
-    if(!mem)
-        return;
+static void ssd1306_smem_write_end(struct ssd1306_dev *ssd1306,unsigned long flags)
+{
+    write_seqcount_end(&ssd1306->smem_seq);
+    spin_unlock_irqrestore(&ssd1306->lock,flags);
+}
+
+/* [col_start,col_end)列所在的8列一组的位图 */
+static u32 ssd1306_col_groups(u32 col_start,u32 col_end)
+{
+    u32 n = DIV_ROUND_UP(col_end,8) - col_start / 8;
 
-    addr = (unsigned long)mem;
+    return (n >= 32 ? ~0u : (1u << n) - 1) << (col_start / 8);
+}
 
-    while((long)size > 0){
-        ClearPageReserved(vmalloc_to_page((void *)addr));
-        addr += PAGE_SIZE;
-        size -= PAGE_SIZE;
+/* 把第page页的[col_start,col_end)列加入脏区,调用者需持有lock */
+static void ssd1306_damage_add_locked(struct ssd1306_damage *damage,int page,u32 col_start,u32 col_end)
+{
+    if(damage->pages & (1u << page)){
+        damage->col_start[page] = min_t(u16,damage->col_start[page],col_start);
+        damage->col_end[page] = max_t(u16,damage->col_end[page],col_end);
+    }else{
+        damage->pages |= 1u << page;
+        damage->col_start[page] = col_start;
+        damage->col_end[page] = col_end;
     }
+}
 
-    vfree(mem);
+/* 
+ * 标记一块矩形区域为脏,坐标为显存中的像素坐标,下次刷新时只发送脏的页和列;
+ * 旋转了90/270度时先换算成屏上的坐标
+ */
+static void ssd1306_damage_rect(struct ssd1306_dev *ssd1306,u32 x,u32 y,u32 width,u32 height)
+{
+    struct fb_info *info = ssd1306->info;
+    const struct ssd1306_variant *variant = ssd1306->variant;
+    struct ssd1306_damage *damage = &ssd1306->damage;
+    unsigned long flags;
+    u32 col_start,col_end,row_start,row_end;
+    int page,page_start,page_end;
+
+    if(x >= info->var.xres || y >= info->var.yres || !width || !height)
+        return;
+    width = min(width,info->var.xres - x);
+    height = min(height,info->var.yres - y);
+
+    switch(ssd1306->rotate){
+        case 90:
+            /* 屏上第c列第r行是显存中的第(width - 1 - c)行第r个点,转换按列取字节,不用对齐 */
+            col_start = variant->width - (y + height);
+            col_end = variant->width - y;
+            row_start = x;
+            row_end = x + width;
+            break;
+        case 270:
+            /* 屏上第c列第r行是显存中的第c行第(height - 1 - r)个点 */
+            col_start = y;
+            col_end = y + height;
+            row_start = variant->height - (x + width);
+            row_end = variant->height - x;
+            break;
+        default:
+            /* 显存中一个字节对应横向8个点,转换时按字节对齐 */
+            col_start = x & ~7;
+            col_end = min_t(u32,ALIGN(x + width,8),info->var.xres);
+            row_start = y;
+            row_end = y + height;
+            break;
+    }
+    page_start = row_start / 8;
+    page_end = (row_end - 1) / 8;
+
+    /* 显存是从别的途径改的,页格式的副本不再是最新的 */
+    spin_lock_irqsave(&ssd1306->lock,flags);
+    for(page = page_start ; page <= page_end ; page++){
+        ssd1306_damage_add_locked(damage,page,col_start,col_end);
+        ssd1306->native_valid[page] &= ~ssd1306_col_groups(col_start,col_end);
+    }
+    spin_unlock_irqrestore(&ssd1306->lock,flags);
 }
 
-/* 写入数据 */
-static int ssd1306_write_data(struct i2c_client *client,const u8 *buf,int len)
+static void ssd1306_damage_all(struct ssd1306_dev *ssd1306)
 {
-    struct i2c_msg msg;
-    int ret,retries;
-    u8 wbuf[len + 1];
+    struct fb_info *info = ssd1306->info;
 
-    /* 需要验证 */
-    wbuf[0] = 0x40;
-    memcpy(&wbuf[1],buf,len);
-    
-    msg.addr = 0x3c;
-    msg.flags = 0;
-    msg.buf = wbuf;
-    msg.len = len + 1;
-    
-    ret = i2c_transfer(client->adapter,&msg,1);
-    
-    if(ret != 1){
-        retries = 0;
-        while(++retries < 5){
-            dev_err(&client->dev,"transfer failed! %d times retry\n",retries);
-            ret = i2c_transfer(client->adapter,&msg,1);
-            if(ret == 1)
-                return 0;
+    ssd1306_damage_rect(ssd1306,0,0,info->var.xres,info->var.yres);
+}
+
+/* 标记显存中[offset,offset + len)这些字节为脏,页格式下一"行"就是一页 */
+static void ssd1306_damage_bytes(struct ssd1306_dev *ssd1306,unsigned long offset,unsigned long len)
+{
+    struct fb_info *info = ssd1306->info;
+    u32 line_start,line_end;
+
+    if(!len)
+        return;
+
+    line_start = offset / info->fix.line_length;
+    line_end = (offset + len - 1) / info->fix.line_length;
+    if(ssd1306->page_major)
+        ssd1306_damage_rect(ssd1306,0,line_start * 8,info->var.xres,(line_end - line_start + 1) * 8);
+    else
+        ssd1306_damage_rect(ssd1306,0,line_start,info->var.xres,line_end - line_start + 1);
+}
+
+/* 开一个[page_start,page_end]页,[col_start,col_end)列的窗口,并写入数据,buf的要求同ssd1306_write_data */
+static int ssd1306_write_window(struct ssd1306_dev *ssd1306,int page_start,int page_end,
+                                int col_start,int col_end,u8 *buf,int len)
+{
+    const struct ssd1306_variant *variant = ssd1306->variant;
+    u8 cmd_buf[SSD_WINDOW_CMD_MAX];
+    int page,page_len,cmd_len;
+    int ret;
+
+    /* 只有页地址模式的控制器,跨页的窗口按页拆开,每页单独开窗口 */
+    if(variant->page_addressing && page_start != page_end){
+        page_len = len / (page_end - page_start + 1);
+        for(page = page_start ; page <= page_end ; page++){
+            ret = ssd1306_write_window(ssd1306,page,page,col_start,col_end,buf,page_len);
+            if(ret)
+                return ret;
+            buf += page_len;
         }
+        return 0;
+    }
+
+    if(ssd1306->ops->write_window)
+        return ssd1306->ops->write_window(ssd1306,page_start,page_end,col_start,col_end,buf,len);
+
+    cmd_len = variant->window_cmd(ssd1306,page_start,page_end,col_start,col_end,cmd_buf);
+    ret = ssd1306_write_cmd_seq(ssd1306,cmd_buf,cmd_len);
+    if(ret)
         return ret;
+    return ssd1306_write_data(ssd1306,buf,len);
+}
+
+/* 将屏幕清0 */
+static void ssd1306_clear(struct ssd1306_dev *ssd1306)
+{
+    int screen_size = ssd1306->variant->height / 8 * ssd1306->page_bytes;
+
+    /* 发送缓冲区中的帧数据每次刷新前都会重新转换,这里可以直接拿来用 */
+    mutex_lock(&ssd1306->io_lock);
+    memset(ssd1306->frame,0,screen_size);
+    ssd1306_write_window(ssd1306,0,ssd1306->variant->height / 8 - 1,0,ssd1306->variant->width,
+                         ssd1306->frame,screen_size);
+    /* 屏上现在全是0,影子跟着清0 */
+    memset(ssd1306->shadow,0,screen_size);
+    mutex_unlock(&ssd1306->io_lock);
+}
+
+/* 8x8 Bayer矩阵,阈值为(n << 2) + 2,灰度0全灭,255全亮 */
+static const u8 ssd1306_bayer8[8][8] = {
+    { 0,32, 8,40, 2,34,10,42},
+    {48,16,56,24,50,18,58,26},
+    {12,44, 4,36,14,46, 6,38},
+    {60,28,52,20,62,30,54,22},
+    { 3,35,11,43, 1,33, 9,41},
+    {51,19,59,27,49,17,57,25},
+    {15,47, 7,39,13,45, 5,37},
+    {63,31,55,23,61,29,53,21},
+};
+
+/* 
+ * 8位灰度显存中,屏上第page页第col列最上面一个点的位置,*step为往下一个点的偏移;
+ * 旋转的换算与ssd1306_convert_mono相同
+ */
+static const u8 *ssd1306_gray8_column(struct ssd1306_dev *ssd1306,const u8 *smem_base,int page,int col,int *step)
+{
+    int line_bytes = ssd1306->info->fix.line_length;
+
+    switch(ssd1306->rotate){
+        case 90:
+            *step = 1;
+            return smem_base + (ssd1306->variant->width - 1 - col) * line_bytes + page * 8;
+        case 270:
+            *step = -1;
+            return smem_base + col * line_bytes + ssd1306->variant->height - 1 - page * 8;
+        default:
+            *step = line_bytes;
+            return smem_base + page * 8 * line_bytes + col;
     }
-    
-    return 0;
 }
 
-/* 写入命令 */
-static int ssd1306_write_cmd(struct i2c_client *client,const u8 *buf,int len)
+/* 有序抖动:取一列8个点与阈值比较,直接拼成oled的一个字节,转置和抖动一次完成 */
+static void ssd1306_dither_ordered(struct ssd1306_dev *ssd1306,const u8 *smem_base,int page,
+                                   int col_start,int col_end,u8 *out)
 {
-    struct i2c_msg msg;
-    int ret,retries;
-    u8 wbuf[len + 1];
-    int i;
-    wbuf[0] = 0x00;
-    memcpy(&wbuf[1],buf,len);
-    
-    // msg.addr = client->addr;
-    msg.addr = 0x3c;
-    msg.flags = 0;
-    msg.buf = wbuf;
-    msg.len = len + 1;
-    
-    for(i = 0 ; i < 2 ; i++){
-        if(i == 1){
-            printk("second times use slave addr : 0x7a\n");
-            msg.addr = 0x3d;
+    const u8 *src;
+    int col,bit,step;
+    u8 data;
+
+    for(col = col_start ; col < col_end ; col++){
+        src = ssd1306_gray8_column(ssd1306,smem_base,page,col,&step);
+        data = 0;
+        for(bit = 0 ; bit < 8 ; bit++){
+            if(src[bit * step] > (ssd1306_bayer8[bit][col & 7] << 2) + 2)
+                data |= 1u << bit;
         }
-        
-        ret = i2c_transfer(client->adapter,&msg,1);
-        
-        if(ret != 1){
-            retries = 0;
-            while(++retries < 5){
-                dev_err(&client->dev,"transfer failed! error no is %d,%d times retry",ret,retries);
-                ret = i2c_transfer(client->adapter,&msg,1);
-                if(ret == 1)
-                    return 0;
+        out[col] = data;
+    }
+}
+
+/* 
+ * Floyd-Steinberg误差扩散:误差向右和向下传递,只能整帧从上到下逐行处理,结果写到out中的各页;
+ * 两行误差的缓冲区左右各多留一个点,边上不用判断
+ */
+static void ssd1306_dither_diffusion(struct ssd1306_dev *ssd1306,const u8 *smem_base,u8 *out)
+{
+    int width = ssd1306->variant->width;
+    int height = ssd1306->variant->height;
+    int page_bytes = ssd1306->page_bytes;
+    s16 *cur = ssd1306->dither_err;
+    s16 *next = cur + width + 2;
+    s16 *tmp;
+    const u8 *src;
+    int row,col,step,val,err;
+
+    memset(cur,0,(width + 2) * sizeof(*cur));
+    memset(out,0,height / 8 * page_bytes);
+    for(row = 0 ; row < height ; row++){
+        memset(next,0,(width + 2) * sizeof(*next));
+        for(col = 0 ; col < width ; col++){
+            src = ssd1306_gray8_column(ssd1306,smem_base,row / 8,col,&step);
+            val = src[(row & 7) * step] + cur[col + 1];
+            if(val > 127){
+                out[row / 8 * page_bytes + col] |= 1u << (row & 7);
+                err = val - 255;
+            }else{
+                err = val;
             }
-            // return ret;
-        }else{
-            return 0;
+            cur[col + 2] += err * 7 / 16;
+            next[col] += err * 3 / 16;
+            next[col + 1] += err * 5 / 16;
+            next[col + 2] += err / 16;
         }
+        tmp = cur;
+        cur = next;
+        next = tmp;
     }
-    return 0;
 }
 
-static int ssd1306_dev_init(struct i2c_client *client)
+/* 
+ * 单色屏:把屏上第page页,[col_start,col_end)列的内容从显存中转换成oled的格式,
+ * oled中一个字节对应纵向8个点,低位在上;页格式下不用转换,直接拷贝.
+ * 旋转90/270度时屏上一页的一列正好是显存中一行里的一个字节,直接按列取字节,
+ * 90度时显存中左边的点在高位,要把位序反过来
+ */
+static void ssd1306_convert_mono(struct ssd1306_dev *ssd1306,const u8 *smem_base,int page,
+                                 int col_start,int col_end,u8 *out)
 {
-    // int i;
-    char cmd_buf[] = {
-        CMD_SET_ADDR_MODE,0x00,CMD_SET_COL_ADDR,0,0x7f,CMD_SET_PAGE_ADDR,0,0x07
-    };
-    
-    // ssd1306_write_cmd(client,"\x00",1);
-    // ssd1306_write_cmd(client,"\x10",1);
-    ssd1306_write_cmd(client,cmd_buf,sizeof(cmd_buf));
-    ssd1306_write_cmd(client,"\x40",1);
-    // ssd1306_write_cmd(client,"\xb0",1);
-    ssd1306_write_cmd(client,"\x81",1);
-    ssd1306_write_cmd(client,"\xff",1);
-    ssd1306_write_cmd(client,"\xa1",1);
-    ssd1306_write_cmd(client,"\xa6",1);
-    ssd1306_write_cmd(client,"\xa8",1);
-    ssd1306_write_cmd(client,"\x3f",1);
-    ssd1306_write_cmd(client,"\xc8",1);
-    ssd1306_write_cmd(client,"\xd3",1);
-    ssd1306_write_cmd(client,"\x00",1);
-
-    ssd1306_write_cmd(client,"\xd5",1);
-    ssd1306_write_cmd(client,"\x80",1);
-
-    ssd1306_write_cmd(client,"\xd8",1);
-    ssd1306_write_cmd(client,"\x05",1);
-
-    ssd1306_write_cmd(client,"\xd9",1);
-    ssd1306_write_cmd(client,"\xf1",1);
-
-    ssd1306_write_cmd(client,"\xda",1);
-    ssd1306_write_cmd(client,"\x12",1);
-
-    ssd1306_write_cmd(client,"\xdb",1);
-    ssd1306_write_cmd(client,"\x30",1);
-
-    ssd1306_write_cmd(client,"\x8d",1);
-    ssd1306_write_cmd(client,"\x14",1);
-
-    ssd1306_write_cmd(client,"\xaf",1);
-    // for(i = 0 ; i < 128 ; i++){
-    //     ssd1306_write_data(client,"\xff",1);
-    // }
-    return 0;
+    int line_bytes = ssd1306->info->fix.line_length;
+    int width = ssd1306->variant->width;
+    int pages = ssd1306->variant->height / 8;
+    int col;
+
+    if(ssd1306->gray8){
+        ssd1306_dither_ordered(ssd1306,smem_base,page,col_start,col_end,out);
+        return;
+    }
+    if(ssd1306->rotate == 90){
+        for(col = col_start ; col < col_end ; col++)
+            out[col] = bitrev8(smem_base[(width - 1 - col) * line_bytes + page]);
+    }else if(ssd1306->rotate == 270){
+        for(col = col_start ; col < col_end ; col++)
+            out[col] = smem_base[col * line_bytes + pages - 1 - page];
+    }else if(ssd1306->page_major)
+        memcpy(out + col_start,smem_base + page * line_bytes + col_start,col_end - col_start);
+    else
+        ssd1306_transpose_page(smem_base + page * 8 * line_bytes,line_bytes,col_start / 8,col_end / 8,out);
 }
 
-static int ssd1306_dev_exit(struct i2c_client *client)
+/* 
+ * 4位灰度屏:RAM也是按行存放的,一个字节2个点,左边的点在高4位,与显存完全一致,
+ * 整页8行直接拷贝
+ */
+static void ssd1306_convert_gray4(struct ssd1306_dev *ssd1306,const u8 *smem_base,int page,
+                                  int col_start,int col_end,u8 *out)
 {
-    ssd1306_write_cmd(client,"\xae",1);
-    return 0;
+    int line_bytes = ssd1306->info->fix.line_length;
+
+    memcpy(out,smem_base + page * 8 * line_bytes,8 * line_bytes);
 }
 
-static void ssd1306_timer_func(unsigned long data)
+/* SSD1306/SSD1309:水平地址模式,一个窗口可以跨页,发送完自动回到窗口开头 */
+static int ssd1306_window_cmd(struct ssd1306_dev *ssd1306,int page_start,int page_end,
+                              int col_start,int col_end,u8 *cmd)
 {
-    struct ssd1306_dev *ssd1306 = (struct ssd1306_dev*)data;
-    
-    /* 在此函数中只将work_struct加入队列，其他耗时的操作在工作函数中完成 */
-    queue_work(ssd1306->wqueue,&ssd1306->work);
+    int offset = ssd1306->variant->col_offset;
+
+    cmd[0] = CMD_SET_COL_ADDR;
+    cmd[1] = offset + col_start;
+    cmd[2] = offset + col_end - 1;
+    cmd[3] = CMD_SET_PAGE_ADDR;
+    cmd[4] = page_start;
+    cmd[5] = page_end;
+    return 6;
 }
 
-/* 将屏幕清0 */
-static void ssd1306_clear(struct ssd1306_dev *ssd1306)
+/* 
+ * SH1106:只能设置页和起始列,列地址写完一个字节自动加1,不会换页;
+ * RAM有132列,128列的屏接在中间,要加上2列的偏移
+ */
+static int sh1106_window_cmd(struct ssd1306_dev *ssd1306,int page_start,int page_end,
+                             int col_start,int col_end,u8 *cmd)
 {
-    struct i2c_client *client = ssd1306->client;
-    struct fb_info *info = ssd1306->info;
-    int screen_size = info->var.xres * info->var.yres / 8;
-    char temp_buf[screen_size];
+    int col = ssd1306->variant->col_offset + col_start;
+
+    cmd[0] = CMD_SET_PAGE_START(page_start);
+    cmd[1] = CMD_SET_LOW_COL_ADDR(col);
+    cmd[2] = CMD_SET_HIGH_COL_ADDR(col >> 4);
+    return 3;
+}
+
+/* 
+ * SSD1322:列地址以4个点为单位,行地址以行为单位,
+ * 设置完窗口后用0x5c进入写RAM状态,之后的数据都写到窗口中
+ */
+static int ssd1322_window_cmd(struct ssd1306_dev *ssd1306,int page_start,int page_end,
+                              int col_start,int col_end,u8 *cmd)
+{
+    int offset = ssd1306->variant->col_offset;
+
+    cmd[0] = 0x15;
+    cmd[1] = 2;
+    cmd[2] = offset + col_start / 4;
+    cmd[3] = offset + col_end / 4 - 1;
+    cmd[4] = 0x75;
+    cmd[5] = 2;
+    cmd[6] = page_start * 8;
+    cmd[7] = page_end * 8 + 7;
+    cmd[8] = 0x5c;
+    cmd[9] = 0;
+    return 10;
+}
+
+/* 0x40|n,一个命令字节,SSD1306/SSD1309/SH1106相同 */
+static int ssd1306_start_line_cmd(u8 line,u8 *cmd)
+{
+    cmd[0] = CMD_SET_START_LINE(line);
+    return 1;
+}
+
+/* 
+ * 支持的控制器.SSD1322的RAM有128行,起始行循环的范围与64行的屏对不上,不支持ywrap;
+ * 它的RAM有480个点宽,256个点的屏一般接在第28列(112个点)开始的位置
+ */
+const struct ssd1306_variant ssd1306_variants[] = {
+    [SSD1306_TYPE_SSD1306] = {
+        .name           = "ssd1306",
+        .width          = 128,
+        .height         = 64,
+        .bpp            = 1,
+        .hw_scroll      = true,
+        .init_seq       = ssd1306_init_seq,
+        .init_seq_len   = sizeof(ssd1306_init_seq),
+        .flip_seq       = ssd1306_flip_seq,
+        .flip_seq_len   = sizeof(ssd1306_flip_seq),
+        .convert_page   = ssd1306_convert_mono,
+        .window_cmd     = ssd1306_window_cmd,
+        .start_line_cmd = ssd1306_start_line_cmd,
+    },
+    [SSD1306_TYPE_SSD1309] = {
+        .name           = "ssd1309",
+        .width          = 128,
+        .height         = 64,
+        .bpp            = 1,
+        .hw_scroll      = true,
+        .init_seq       = ssd1309_init_seq,
+        .init_seq_len   = sizeof(ssd1309_init_seq),
+        .flip_seq       = ssd1306_flip_seq,
+        .flip_seq_len   = sizeof(ssd1306_flip_seq),
+        .convert_page   = ssd1306_convert_mono,
+        .window_cmd     = ssd1306_window_cmd,
+        .start_line_cmd = ssd1306_start_line_cmd,
+    },
+    [SSD1306_TYPE_SH1106] = {
+        .name           = "sh1106",
+        .width          = 128,
+        .height         = 64,
+        .bpp            = 1,
+        .col_offset     = 2,
+        .page_addressing = true,
+        .init_seq       = sh1106_init_seq,
+        .init_seq_len   = sizeof(sh1106_init_seq),
+        .flip_seq       = ssd1306_flip_seq,
+        .flip_seq_len   = sizeof(ssd1306_flip_seq),
+        .convert_page   = ssd1306_convert_mono,
+        .window_cmd     = sh1106_window_cmd,
+        .start_line_cmd = ssd1306_start_line_cmd,
+    },
+    [SSD1306_TYPE_SSD1322] = {
+        .name           = "ssd1322",
+        .width          = 256,
+        .height         = 64,
+        .bpp            = 4,
+        .col_offset     = 28,
+        .args_as_data   = true,
+        .init_seq       = ssd1322_init_seq,
+        .init_seq_len   = sizeof(ssd1322_init_seq),
+        .flip_seq       = ssd1322_flip_seq,
+        .flip_seq_len   = sizeof(ssd1322_flip_seq),
+        .convert_page   = ssd1306_convert_gray4,
+        .window_cmd     = ssd1322_window_cmd,
+    },
+};
+
+/* 
+ * 单色屏中有控制台文字的页:文字所在的列从页格式的副本中直接拷贝,
+ * 其余的列照常转换,列范围都是8列对齐的
+ */
+static void ssd1306_convert_cached(struct ssd1306_dev *ssd1306,const u8 *smem_base,int page,
+                                   int col_start,int col_end,u32 valid,u8 *out)
+{
+    const u8 *native = ssd1306->native + page * ssd1306->page_bytes;
+    int col,end;
+    bool cached;
+
+    for(col = col_start ; col < col_end ; col = end){
+        cached = valid & (1u << (col / 8));
+        for(end = col + 8 ; end < col_end && !!(valid & (1u << (end / 8))) == cached ; end += 8)
+            ;
+        end = min(end,col_end);
+        if(cached)
+            memcpy(out + col,native + col,end - col);
+        else
+            ssd1306->variant->convert_page(ssd1306,smem_base,page,col,end,out);
+    }
+}
+
+/* 
+ * 把所有脏页转换到out中,valid为各页在页格式副本中是最新的列;
+ * 误差扩散时脏区总是整屏,整帧一起转换
+ */
+static void ssd1306_convert_damage(struct ssd1306_dev *ssd1306,const u8 *smem_base,
+                                   const struct ssd1306_damage *damage,const u32 *valid,
+                                   bool diffusion,u8 *out)
+{
+    int page_bytes = ssd1306->page_bytes;
+    int pages = ssd1306->variant->height / 8;
+    int page;
+
+    if(diffusion){
+        ssd1306_dither_diffusion(ssd1306,smem_base,out);
+        return;
+    }
+
+    for(page = 0 ; page < pages ; page++){
+        if(!(damage->pages & (1u << page)))
+            continue;
+        if(valid[page])
+            ssd1306_convert_cached(ssd1306,smem_base,page,damage->col_start[page],
+                                   damage->col_end[page],valid[page],out + page * page_bytes);
+        else
+            ssd1306->variant->convert_page(ssd1306,smem_base,page,damage->col_start[page],
+                                           damage->col_end[page],out + page * page_bytes);
+    }
+}
+
+/* 
+ * 与影子比较,把每个脏页的列范围收缩到真正发生变化的部分,
+ * 没有任何变化的页从脏页中去掉
+ */
+static void ssd1306_diff_shadow(struct ssd1306_dev *ssd1306,struct ssd1306_damage *damage,
+                                const u8 *buf,int pages)
+{
+    int page_bytes = ssd1306->page_bytes;
+    const u8 *new,*old;
+    int page,start,end;
+
+    for(page = 0 ; page < pages ; page++){
+        if(!(damage->pages & (1u << page)))
+            continue;
+
+        new = buf + page * page_bytes;
+        old = ssd1306->shadow + page * page_bytes;
+        /* 灰度屏只能整页发送,整页比较 */
+        if(ssd1306->variant->bpp != 1){
+            if(!memcmp(new,old,page_bytes))
+                damage->pages &= ~(1u << page);
+            continue;
+        }
+        start = damage->col_start[page];
+        end = damage->col_end[page];
+        while(start < end && new[start] == old[start])
+            start++;
+        while(end > start && new[end - 1] == old[end - 1])
+            end--;
+
+        if(start == end){
+            damage->pages &= ~(1u << page);
+        }else{
+            damage->col_start[page] = start;
+            damage->col_end[page] = end;
+        }
+    }
+}
+
+/* 把第first页开始还没有发送的脏页放回脏区,留到下一次刷新 */
+static void ssd1306_damage_requeue(struct ssd1306_dev *ssd1306,const struct ssd1306_damage *damage,
+                                   int first,int pages)
+{
+    unsigned long flags;
+    int page;
+
+    spin_lock_irqsave(&ssd1306->lock,flags);
+    for(page = first ; page < pages ; page++){
+        if(damage->pages & (1u << page))
+            ssd1306_damage_add_locked(&ssd1306->damage,page,damage->col_start[page],damage->col_end[page]);
+    }
+    spin_unlock_irqrestore(&ssd1306->lock,flags);
+}
+
+/* 停止硬件滚动,调用者需持有io_lock */
+static int ssd1306_stop_scroll_locked(struct ssd1306_dev *ssd1306)
+{
+    u8 cmd = CMD_DEACTIVATE_SCROLL;
+    int ret;
 
-    memset(temp_buf,0,sizeof(temp_buf));
-    ssd1306_write_data(client,temp_buf,sizeof(temp_buf));
+    ret = ssd1306_write_cmd(ssd1306,&cmd,1);
+    if(!ret)
+        ssd1306->scrolling = false;
+    return ret;
 }
 
-/* 将内存上的内容同步到oled上 */
-static void ssd1306_sync_buffer(struct ssd1306_dev *ssd1306)
+/* 
+ * 将内存上的脏区同步到oled上,返回发送的字节数,没有变化时返回0;
+ * use_budget为真时受bus_budget_us限制,超出时剩下的页放回脏区.
+ * bus_ns返回发送窗口花的时间,不含等锁,转换和比较
+ */
+static int ssd1306_sync_buffer(struct ssd1306_dev *ssd1306,bool use_budget,u64 *bus_ns)
 {
     struct fb_info *info = ssd1306->info;
-    struct i2c_client *client = ssd1306->client;
+    struct ssd1306_damage damage;
+    u32 valid[SSD_MAX_PAGES];
     unsigned char *smem_base;
-    int screen_width,screen_height;
-    int line_bytes,i,j,k,bits;
-    int srceen_size = info->screen_size;
-    char byte_data;
-    char transfrom_data[srceen_size];
+    unsigned long flags;
+    int screen_width,page_bytes,pages;
+    int page,last,offset,len;
+    int sent = 0;
+    int ret,failed = 0;
+    int tries;
+    unsigned int seq;
+    u64 bus_start,budget;
+    bool diffusion;
+    u8 *transfrom_data = ssd1306->frame;
    
+    *bus_ns = 0;
     smem_base = info->screen_base;
     if(!smem_base){
         smem_base = (unsigned char *)info->fix.smem_start;
     }
     if(!smem_base){
-        return;
+        return 0;
     }
 
-    screen_width = info->var.xres;
-    screen_height = info->var.yres;
-    line_bytes = screen_width / 8;
-
-    k = 0;
-    for(i = 0 ; i < screen_height / 8 ; i++){
-        for(j = 0 ; j < screen_width / 8 ; j++){
-            bits = 0;
-            for(bits = 0 ; bits < 8 ;bits++){
-                byte_data = 0;
-                byte_data |= ((*(smem_base + (i * 8 + 0) * line_bytes + j) << bits) & 0x80) >> 7;
-                byte_data |= ((*(smem_base + (i * 8 + 1) * line_bytes + j) << bits) & 0x80) >> 6;
-                byte_data |= ((*(smem_base + (i * 8 + 2) * line_bytes + j) << bits) & 0x80) >> 5;
-                byte_data |= ((*(smem_base + (i * 8 + 3) * line_bytes + j) << bits) & 0x80) >> 4;
-                byte_data |= ((*(smem_base + (i * 8 + 4) * line_bytes + j) << bits) & 0x80) >> 3;
-                byte_data |= ((*(smem_base + (i * 8 + 5) * line_bytes + j) << bits) & 0x80) >> 2;
-                byte_data |= ((*(smem_base + (i * 8 + 6) * line_bytes + j) << bits) & 0x80) >> 1;
-                byte_data |= ((*(smem_base + (i * 8 + 7) * line_bytes + j) << bits) & 0x80) >> 0;
-                transfrom_data[k++] = byte_data;
-                // ssd1306_write_data(client,&byte_data,1);
-            }
+    /* 取出脏区并清空,之后新产生的脏区留到下一次刷新 */
+    spin_lock_irqsave(&ssd1306->lock,flags);
+    damage = ssd1306->damage;
+    ssd1306->damage.pages = 0;
+    memcpy(valid,ssd1306->native_valid,sizeof(valid));
+    spin_unlock_irqrestore(&ssd1306->lock,flags);
+
+    if(!damage.pages)
+        return 0;
+
+    /* 以下都是屏上的坐标,旋转90/270度时与var中的宽高是反的 */
+    screen_width = ssd1306->variant->width;
+    page_bytes = ssd1306->page_bytes;
+    pages = ssd1306->variant->height / 8;
+
+    mutex_lock(&ssd1306->io_lock);
+
+    /* 滚动时不能写GDDRAM,先停下来;滚过的屏要整屏重发 */
+    if(ssd1306->scrolling)
+        ssd1306_stop_scroll_locked(ssd1306);
+    /* 误差扩散时一个点的变化会影响到后面所有的点,整帧转换,比较影子后只发送变化的部分 */
+    diffusion = ssd1306->gray8 && ssd1306->dither == SSD1306_DITHER_DIFFUSION;
+    if(ssd1306->shadow_stale || diffusion)
+        damage.pages = (1u << pages) - 1;
+    /* 灰度屏一页8行在发送缓冲区中按行存放,部分列不连续,只能整页发送 */
+    for(page = 0 ; page < pages ; page++){
+        if(ssd1306->shadow_stale || ssd1306->variant->bpp != 1 || diffusion){
+            damage.col_start[page] = 0;
+            damage.col_end[page] = screen_width;
         }
     }
 
-    ssd1306_write_data(client,transfrom_data,k);
+    /* 
+     * 直接转换到发送缓冲区中.转换过程中显存被write或fbcon改过时重新转换,
+     * 重试几次还不行就持锁转换,发出去的总是完整的一帧
+     */
+    for(tries = 0 ; ; tries++){
+        if(tries < SSD_CONVERT_RETRIES){
+            seq = read_seqcount_begin(&ssd1306->smem_seq);
+            ssd1306_convert_damage(ssd1306,smem_base,&damage,valid,diffusion,transfrom_data);
+            if(!read_seqcount_retry(&ssd1306->smem_seq,seq))
+                break;
+        }else{
+            spin_lock_irqsave(&ssd1306->lock,flags);
+            ssd1306_convert_damage(ssd1306,smem_base,&damage,valid,diffusion,transfrom_data);
+            spin_unlock_irqrestore(&ssd1306->lock,flags);
+            break;
+        }
+    }
+
+    /* 屏上已经是这些内容了,整帧都不用发 */
+    if(!ssd1306->shadow_stale)
+        ssd1306_diff_shadow(ssd1306,&damage,transfrom_data,pages);
+    if(!damage.pages){
+        ssd1306->frames_skipped++;
+        mutex_unlock(&ssd1306->io_lock);
+        return 0;
+    }
+
+    /* 
+     * 滚动之后要整屏重发,不受预算限制,否则影子一直不可信;
+     * 至少发送一个窗口,保证每次刷新都有进展
+     */
+    budget = (u64)ssd1306->bus_budget_us * NSEC_PER_USEC;
+    if(ssd1306->shadow_stale)
+        use_budget = false;
+    bus_start = ktime_get_ns();
+
+    for(page = 0 ; page < pages ; page = last + 1){
+        last = page;
+        if(!(damage.pages & (1u << page)))
+            continue;
+
+        if(use_budget && budget && sent && ktime_get_ns() - bus_start >= budget){
+            ssd1306_damage_requeue(ssd1306,&damage,page,pages);
+            ssd1306->stats.budget_cuts++;
+            break;
+        }
+
+        if(damage.col_start[page] == 0 && damage.col_end[page] == screen_width){
+            /* 
+             * 相邻的整页合并成一个窗口,数据在转换缓冲区中是连续的;
+             * 让出总线时每页单独一个窗口,对i2c来说就是单独一次传输,
+             * 两次传输之间适配器的锁是放开的,等着的其他设备可以先用
+             */
+            while(!ssd1306->fair_bus && last + 1 < pages && (damage.pages & (1u << (last + 1))) &&
+                  damage.col_start[last + 1] == 0 && damage.col_end[last + 1] == screen_width)
+                last++;
+            offset = page * page_bytes;
+            len = (last - page + 1) * page_bytes;
+            ret = ssd1306_write_window(ssd1306,page,last,0,screen_width,transfrom_data + offset,len);
+        }else{
+            /* 只有单色屏会走到这里,一列正好一个字节 */
+            offset = page * page_bytes + damage.col_start[page];
+            len = damage.col_end[page] - damage.col_start[page];
+            ret = ssd1306_write_window(ssd1306,page,page,damage.col_start[page],damage.col_end[page],
+                                       transfrom_data + offset,len);
+        }
+        /* 
+         * 失败的页放回脏区,工作函数看到还有脏区会按刷新间隔再安排一次;
+         * 发送成功的部分才更新影子,失败的部分下次还会被比较出来
+         */
+        if(ret){
+            ssd1306_damage_requeue(ssd1306,&damage,page,last + 1);
+            ssd1306->stats.errors++;
+            failed = 1;
+            continue;
+        }
+        memcpy(ssd1306->shadow + offset,transfrom_data + offset,len);
+        sent += len;
+    }
+    *bus_ns = ktime_get_ns() - bus_start;
+    if(!failed)
+        ssd1306->shadow_stale = false;
+    mutex_unlock(&ssd1306->io_lock);
+    if(sent)
+        ssd1306->frames_flushed++;
+    return sent;
+}
+
+/* 
+ * 安排一次刷新,两次刷新之间至少间隔1/target_fps,内容一直不变时这个间隔会逐渐放大;
+ * 另外上一帧在总线上花了多久,结束之后至少再空出同样长的时间,
+ * 总线再慢也不会被刷新占满,同一总线上的其他设备总有机会
+ */
+static void __ssd1306_schedule_flush(struct ssd1306_dev *ssd1306,u64 min_wait)
+{
+    u64 now = ktime_get_ns();
+    u64 interval,next;
+    unsigned long delay = 0;
+
+    interval = div_u64(NSEC_PER_SEC,ssd1306->target_fps) * ssd1306->backoff;
+    next = max(ssd1306->last_start + interval,ssd1306->last_xfer_end + ssd1306->last_xfer_ns);
+    next = max(next,now + min_wait);
+    if(next > now)
+        delay = usecs_to_jiffies(div_u64(next - now,NSEC_PER_USEC));
+
+    /* 已经安排了的话不会重复安排,不会出现一次接一次的连续刷新 */
+    queue_delayed_work(ssd1306->wqueue,&ssd1306->work,delay);
+}
+
+static void ssd1306_schedule_flush(struct ssd1306_dev *ssd1306)
+{
+    __ssd1306_schedule_flush(ssd1306,0);
+}
+
+/* 
+ * 拼接屏把一块矩形拷贝到成员屏的显存中并安排刷新.src指向源中(x,y)点所在的字节,
+ * pitch为源一行的字节数;按字节对齐后整字节拷贝,拼接屏保证各块的边界落在字节上
+ */
+void ssd1306_core_blit(struct ssd1306_dev *ssd1306,const u8 *src,u32 pitch,
+                       u32 x,u32 y,u32 width,u32 height)
+{
+    u32 line_bytes = ssd1306->info->fix.line_length;
+    u32 bpp = ssd1306->info->var.bits_per_pixel;
+    u8 *dst = (u8 *)ssd1306->video_mem + y * line_bytes + x * bpp / 8;
+    u32 bytes = DIV_ROUND_UP((x + width) * bpp,8) - x * bpp / 8;
+    unsigned long flags;
+    u32 row;
+
+    ssd1306_smem_write_begin(ssd1306,&flags);
+    for(row = 0 ; row < height ; row++)
+        memcpy(dst + row * line_bytes,src + row * pitch,bytes);
+    ssd1306_smem_write_end(ssd1306,flags);
+
+    ssd1306_damage_rect(ssd1306,x,y,width,height);
+    ssd1306_schedule_flush(ssd1306);
+}
+
+/* 按log2(us)把一个时间计入直方图 */
+static void ssd1306_hist_add(unsigned long *hist,u64 ns)
+{
+    u32 us = min_t(u64,div_u64(ns,NSEC_PER_USEC),U32_MAX);
+    int bucket = us ? ilog2(us) : 0;
+
+    hist[min(bucket,SSD_HIST_BUCKETS - 1)]++;
+}
+
+/* 统计实际的刷新率,每秒更新一次 */
+static void ssd1306_account_frame(struct ssd1306_dev *ssd1306,u64 now)
+{
+    u64 elapsed = now - ssd1306->fps_window_start;
+
+    ssd1306->fps_window_frames++;
+    if(elapsed >= NSEC_PER_SEC){
+        ssd1306->achieved_fps = div64_u64((u64)ssd1306->fps_window_frames * NSEC_PER_SEC,elapsed);
+        ssd1306->fps_window_start = now;
+        ssd1306->fps_window_frames = 0;
+    }
+}
+
+/* 
+ * 把pan_display要求的起始行发给屏,只有一个命令字节;
+ * 放在数据之后发送,先画好再切换,返回发送的字节数,发送花的时间加到bus_ns上
+ */
+static int ssd1306_sync_start_line(struct ssd1306_dev *ssd1306,u64 *bus_ns)
+{
+    unsigned long flags;
+    u8 line,cmd[SSD_WINDOW_CMD_MAX];
+    int ret,len;
+    u64 start;
+
+    spin_lock_irqsave(&ssd1306->lock,flags);
+    line = ssd1306->start_line;
+    spin_unlock_irqrestore(&ssd1306->lock,flags);
+    if(line == ssd1306->hw_start_line)
+        return 0;
+
+    len = ssd1306->variant->start_line_cmd(line,cmd);
+    mutex_lock(&ssd1306->io_lock);
+    start = ktime_get_ns();
+    ret = ssd1306_write_cmd_seq(ssd1306,cmd,len);
+    *bus_ns += ktime_get_ns() - start;
+    if(!ret)
+        ssd1306->hw_start_line = line;
+    mutex_unlock(&ssd1306->io_lock);
+    return ret ? 0 : 1;
 }
 
 static void ssd1306_work_func(struct work_struct *work)
 {
-    struct ssd1306_dev *ssd1306 = container_of(work,struct ssd1306_dev,work);
-    unsigned long expire_time = jiffies + SSD_FLUSH_INTERVAL;
-    
-    ssd1306_sync_buffer(ssd1306);
-   
-    /* 重新启动定时器 */
-    if(time_after_eq(expire_time,jiffies)){
-        ssd1306->timer.expires = expire_time;
-        add_timer(&ssd1306->timer);
-    }else{
-        ssd1306->timer.expires = jiffies;
-        add_timer(&ssd1306->timer);
-    }  
+    struct ssd1306_dev *ssd1306 = container_of(to_delayed_work(work),struct ssd1306_dev,work);
+    unsigned long flags;
+    u64 start,end,prev_start,bus_ns;
+    u32 fence;
+    int sent;
+    u8 pending;
+
+    /* 
+     * 在这之前请求的栅栏,这次刷新完成后就都满足了;
+     * remove之后fb还开着时,关闭或者写映射还会安排刷新,这时什么都不做
+     */
+    spin_lock_irqsave(&ssd1306->lock,flags);
+    fence = ssd1306->fence_req;
+    if(ssd1306->removed){
+        spin_unlock_irqrestore(&ssd1306->lock,flags);
+        return;
+    }
+    spin_unlock_irqrestore(&ssd1306->lock,flags);
+
+    /* 刷新过程中又有新的脏区时,按这次的开始时间来安排下一次 */
+    start = ktime_get_ns();
+    prev_start = ssd1306->last_start;
+    ssd1306->last_start = start;
+
+    /* 
+     * 有人在等栅栏时整帧都要发完,不受总线预算限制;
+     * 统计和调度只用真正占用总线的时间,等io_lock和转换的时间总线是空着的
+     */
+    sent = ssd1306_sync_buffer(ssd1306,fence == ssd1306->fence_done,&bus_ns);
+    sent += ssd1306_sync_start_line(ssd1306,&bus_ns);
+    end = ktime_get_ns();
+
+    if(sent){
+        ssd1306->last_xfer_end = end;
+        ssd1306->last_xfer_ns = bus_ns;
+        ssd1306->backoff = 1;
+        ssd1306_account_frame(ssd1306,end);
+        ssd1306->stats.bytes_sent += sent;
+        ssd1306_hist_add(ssd1306->stats.xfer_hist,bus_ns);
+        if(prev_start)
+            ssd1306_hist_add(ssd1306->stats.interval_hist,start - prev_start);
+    }else if(ssd1306->backoff < SSD_MAX_BACKOFF){
+        /* 有人在写,但写的内容和屏上一样,放慢一些,省下转换和比较的开销 */
+        ssd1306->backoff *= 2;
+    }
+
+    ssd1306->fence_done = fence;
+    wake_up_interruptible_all(&ssd1306->fence_wait);
+
+    /* 超出预算没发完的页已经放回脏区,按刷新间隔接着发 */
+    spin_lock_irqsave(&ssd1306->lock,flags);
+    pending = ssd1306->damage.pages;
+    spin_unlock_irqrestore(&ssd1306->lock,flags);
+    if(pending)
+        ssd1306_schedule_flush(ssd1306);
 }
 
-static int ssd1306_fb_open(struct fb_info *info, int user)
+/* 
+ * 映射到用户空间的显存被写过之后,fb_deferred_io会在延迟一帧的时间后
+ * 把写过的页交给这个函数,没有写就不会有任何刷新
+ */
+static void ssd1306_deferred_io(struct fb_info *info,struct list_head *pagelist)
 {
     struct ssd1306_dev *ssd1306 = info->par;
-    struct i2c_client *client = ssd1306->client;
-    
-    ssd1306_dev_init(client);
+    unsigned long offset;
+    struct page *page;
+
+    list_for_each_entry(page,pagelist,lru){
+        offset = page->index << PAGE_SHIFT;
+        if(offset >= info->screen_size)
+            continue;
+        ssd1306_damage_bytes(ssd1306,offset,min(PAGE_SIZE,info->screen_size - offset));
+    }
 
-    /* 初始化定时器，但并不在此函数内启动，在mmap函数中启动 */
-    INIT_WORK(&ssd1306->work,ssd1306_work_func);
-    init_timer(&ssd1306->timer);
-    ssd1306->timer.function = ssd1306_timer_func;
-    ssd1306->timer.data = (unsigned long)ssd1306;
+    /* 手动提交时只记下脏区,等SSD1306_IOC_FLUSH */
+    if(!ssd1306->manual_commit)
+        ssd1306_schedule_flush(ssd1306);
+}
 
-    /* 将屏幕清0 */
-    ssd1306_clear(ssd1306);
+/* 屏在probe时已经初始化并清屏,打开时不用再做一遍 */
+static int ssd1306_fb_open(struct fb_info *info, int user)
+{
+    struct ssd1306_dev *ssd1306 = info->par;
 
+    ssd1306->open_count++;
     return 0;
 }
 
+/* 
+ * 最后一个用户关闭时,把还在延迟中的内容马上刷到屏上,不用再等一帧的延迟;
+ * 刷新只由写入触发,之后没有人写就不会再有任何总线传输
+ */
 static int ssd1306_fb_release(struct fb_info *info, int user)
 {
-    // del_timer(&ssd1306_dev.timer);
-    // ssd1306_dev_exit(ssd1306_dev.client);
+    struct ssd1306_dev *ssd1306 = info->par;
+
+    if(--ssd1306->open_count == 0){
+        flush_delayed_work(&info->deferred_work);
+        mod_delayed_work(ssd1306->wqueue,&ssd1306->work,0);
+    }
     return 0;
 }
 
@@ -310,6 +1092,7 @@ ssize_t ssd1306_fb_write(struct fb_info *info, const char __user *buf,size_t cou
 {
     struct ssd1306_dev *ssd1306 = info->par;
     unsigned long p = *ppos;
+    unsigned long flags;
 	void *dst;
 	int err = 0;
 	unsigned long total_size;
@@ -342,184 +1125,1087 @@ ssize_t ssd1306_fb_write(struct fb_info *info, const char __user *buf,size_t cou
 	if (info->fbops->fb_sync)
 		info->fbops->fb_sync(info);
 
-	if (copy_from_user(dst, buf, count))
-		err = -EFAULT;
+    /* 
+     * 先拷贝到write_buf中,再在写区间中一次拷贝到显存,
+     * 刷新转换时看到的要么是写之前的内容,要么是写完之后的,不会是一半
+     */
+    mutex_lock(&ssd1306->write_lock);
+    if(copy_from_user(ssd1306->write_buf,buf,count)){
+        mutex_unlock(&ssd1306->write_lock);
+        return -EFAULT;
+    }
+    ssd1306_smem_write_begin(ssd1306,&flags);
+    memcpy(dst,ssd1306->write_buf,count);
+    ssd1306_smem_write_end(ssd1306,flags);
+    mutex_unlock(&ssd1306->write_lock);
 
 	if  (!err)
 		*ppos += count;
 
-    /* 如果已经映射了内存,则什么也不用做,因为稍后内存会自动同步到oled上的 */
-    if(ssd1306->is_mapped){
-        return (err) ? err : count;;
+    ssd1306_damage_bytes(ssd1306,p,count);
+
+    /* 
+     * write不经过缺页,映射与否都要自己安排刷新.默认不等待,至少攒一帧的时间再刷新,
+     * 连续的多次小write合并成一次传输;需要确认写到屏上的可以用SSD1306_IOC_FLUSH,
+     * 或者把sync_write设为1,恢复原来立即刷新并等待完成的行为
+     */
+    if(ssd1306->sync_write){
+        mod_delayed_work(ssd1306->wqueue,&ssd1306->work,0);
+        flush_delayed_work(&ssd1306->work);
     }else{
-        ssd1306_sync_buffer(ssd1306);
+        __ssd1306_schedule_flush(ssd1306,div_u64(NSEC_PER_SEC,ssd1306->target_fps));
     }
 
 	return (err) ? err : count;
 }
 
-int ssd1306_fb_mmap(struct fb_info *info, struct vm_area_struct *vma)
+/* 
+ * 在字形缓存中按内容查找一个8点宽的单元,没有时转换成页格式放入缓存,
+ * 替换掉同一位置上原来的字形;调用者需持有lock
+ */
+static const struct ssd1306_glyph *ssd1306_glyph_lookup(struct ssd1306_dev *ssd1306,const u8 *bits,int height)
+{
+    struct ssd1306_glyph *glyph = &ssd1306->glyphs[jhash(bits,height,height) % SSD_GLYPH_CACHE_SIZE];
+    int page;
+
+    if(glyph->height == height && !memcmp(glyph->bits,bits,height)){
+        ssd1306->stats.glyph_hits++;
+        return glyph;
+    }
+
+    ssd1306->stats.glyph_misses++;
+    glyph->height = height;
+    memcpy(glyph->bits,bits,height);
+    for(page = 0 ; page < height / 8 ; page++)
+        ssd1306_transpose_page(bits + page * 8,1,0,1,glyph->native + page * 8);
+    return glyph;
+}
+
+/* 
+ * 控制台文字的快速路径:fbcon画的字是单色的,宽度和位置一般都是8的倍数,
+ * 一次可能画一串字.按8点宽的单元逐个写入显存,同时从字形缓存中取出页格式
+ * 写到页格式的副本中,刷新时这些列直接拷贝,不用再转换.
+ * 不是按页对齐的单色图像时返回false,交给cfb_imageblit
+ */
+static bool ssd1306_glyph_blit(struct ssd1306_dev *ssd1306,const struct fb_image *image)
+{
+    struct fb_info *info = ssd1306->info;
+    const struct ssd1306_glyph *glyph;
+    int line_bytes = info->fix.line_length;
+    int page_bytes = ssd1306->page_bytes;
+    int pitch = image->width / 8;
+    int pages = image->height / 8;
+    u8 fg = (image->fg_color & 1) ? 0xff : 0x00;
+    u8 bg = (image->bg_color & 1) ? 0xff : 0x00;
+    u8 bits[SSD_GLYPH_MAX_HEIGHT];
+    unsigned long flags;
+    u8 *smem,*native;
+    int cell,row,page;
+    u8 data;
+
+    if(!ssd1306->glyphs || ssd1306->gray8 || ssd1306->rotate == 90 || ssd1306->rotate == 270 || image->depth != 1 ||
+       !image->width || !image->height || ((image->dx | image->dy | image->width | image->height) & 7) ||
+       image->height > SSD_GLYPH_MAX_HEIGHT ||
+       image->dx + image->width > info->var.xres || image->dy + image->height > info->var.yres)
+        return false;
+
+    smem = (u8 *)ssd1306->video_mem + image->dy * line_bytes + image->dx / 8;
+    native = ssd1306->native + image->dy / 8 * page_bytes + image->dx;
+
+    ssd1306_smem_write_begin(ssd1306,&flags);
+    for(cell = 0 ; cell < pitch ; cell++){
+        for(row = 0 ; row < image->height ; row++){
+            data = image->data[row * pitch + cell];
+            bits[row] = (data & fg) | (~data & bg);
+            smem[row * line_bytes + cell] = bits[row];
+        }
+        glyph = ssd1306_glyph_lookup(ssd1306,bits,image->height);
+        for(page = 0 ; page < pages ; page++)
+            memcpy(native + page * page_bytes + cell * 8,glyph->native + page * 8,8);
+    }
+    for(page = image->dy / 8 ; page < image->dy / 8 + pages ; page++){
+        ssd1306_damage_add_locked(&ssd1306->damage,page,image->dx,image->dx + image->width);
+        ssd1306->native_valid[page] |= ssd1306_col_groups(image->dx,image->dx + image->width);
+    }
+    ssd1306_smem_write_end(ssd1306,flags);
+    return true;
+}
+
+/* 
+ * 以下三个函数供fbcon使用,在写区间中画图,画完后标记脏区并安排一次刷新;
+ * cfb只认行格式,页格式下不画
+ */
+static void ssd1306_fillrect(struct fb_info *info,const struct fb_fillrect *rect)
 {
     struct ssd1306_dev *ssd1306 = info->par;
-    unsigned long start = vma->vm_start;
-	unsigned long size = vma->vm_end - vma->vm_start;
-	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
-	unsigned long page, pos;
-    
-    if(ssd1306->is_mapped){
+    unsigned long flags;
+
+    if(ssd1306->page_major)
+        return;
+    ssd1306_smem_write_begin(ssd1306,&flags);
+    cfb_fillrect(info,rect);
+    ssd1306_smem_write_end(ssd1306,flags);
+    ssd1306_damage_rect(ssd1306,rect->dx,rect->dy,rect->width,rect->height);
+    ssd1306_schedule_flush(ssd1306);
+}
+
+static void ssd1306_copyarea(struct fb_info *info,const struct fb_copyarea *area)
+{
+    struct ssd1306_dev *ssd1306 = info->par;
+    unsigned long flags;
+
+    if(ssd1306->page_major)
+        return;
+    ssd1306_smem_write_begin(ssd1306,&flags);
+    cfb_copyarea(info,area);
+    ssd1306_smem_write_end(ssd1306,flags);
+    ssd1306_damage_rect(ssd1306,area->dx,area->dy,area->width,area->height);
+    ssd1306_schedule_flush(ssd1306);
+}
+
+static void ssd1306_imageblit(struct fb_info *info,const struct fb_image *image)
+{
+    struct ssd1306_dev *ssd1306 = info->par;
+    unsigned long flags;
+
+    if(ssd1306->page_major)
+        return;
+    if(ssd1306_glyph_blit(ssd1306,image)){
+        ssd1306_schedule_flush(ssd1306);
+        return;
+    }
+    ssd1306_smem_write_begin(ssd1306,&flags);
+    cfb_imageblit(info,image);
+    ssd1306_smem_write_end(ssd1306,flags);
+    ssd1306_damage_rect(ssd1306,image->dx,image->dy,image->width,image->height);
+    ssd1306_schedule_flush(ssd1306);
+}
+
+/* 切换显存格式,并在fix/var中公布,让用户程序可以识别出来 */
+static void ssd1306_set_format(struct ssd1306_dev *ssd1306,bool page_major)
+{
+    struct fb_info *info = ssd1306->info;
+    struct fb_var_screeninfo *var = &info->var;
+
+    ssd1306->page_major = page_major;
+    ssd1306->gray8 = var->bits_per_pixel > ssd1306->variant->bpp;
+    /* 两种格式下都是每行xres个点,页格式只是换了排列方式 */
+    info->screen_size = var->xres * var->yres * var->bits_per_pixel / 8;
+    info->fix.capabilities = FB_CAP_FOURCC;
+    if(page_major){
+        info->fix.type = FB_TYPE_FOURCC;
+        info->fix.visual = FB_VISUAL_FOURCC;
+        info->fix.line_length = var->xres;
+        var->nonstd = SSD1306_NONSTD_PAGE_MAJOR;
+        var->grayscale = SSD1306_FOURCC_PAGE_MAJOR;
+    }else if(var->bits_per_pixel == 1){
+        info->fix.type = FB_TYPE_PACKED_PIXELS;
+        info->fix.visual = FB_VISUAL_MONO10;
+        info->fix.line_length = var->xres / 8;
+        var->nonstd = 0;
+        var->grayscale = 0;
+    }else{
+        /* 灰度屏:像素值就是灰度等级,一个字节中左边的点在高位;单色屏的8位灰度显存也是这样 */
+        info->fix.type = FB_TYPE_PACKED_PIXELS;
+        info->fix.visual = FB_VISUAL_STATIC_PSEUDOCOLOR;
+        info->fix.line_length = var->xres * var->bits_per_pixel / 8;
+        var->nonstd = 0;
+        var->grayscale = 1;
+    }
+}
+
+/* 色深由控制器决定,灰度屏的三个颜色分量都是整个像素 */
+static void ssd1306_set_bitfields(struct fb_var_screeninfo *var,u32 bpp)
+{
+    var->bits_per_pixel = bpp;
+    memset(&var->red,0,sizeof(var->red));
+    memset(&var->green,0,sizeof(var->green));
+    memset(&var->blue,0,sizeof(var->blue));
+    memset(&var->transp,0,sizeof(var->transp));
+    if(bpp > 1)
+        var->red.length = var->green.length = var->blue.length = bpp;
+}
+
+/* 起始行移动的是屏上的行,旋转了90/270度时对应的是显存中的列,不能用来平移 */
+static bool ssd1306_can_ywrap(struct ssd1306_dev *ssd1306)
+{
+    return ssd1306->variant->start_line_cmd && (ssd1306->rotate == 0 || ssd1306->rotate == 180);
+}
+
+static int ssd1306_fb_check_var(struct fb_var_screeninfo *var,struct fb_info *info)
+{
+    struct ssd1306_dev *ssd1306 = info->par;
+    u32 bpp = ssd1306->variant->bpp;
+    bool page_major;
+
+    /* 以nonstd为准,按照FOURCC的约定在grayscale中给出页格式的代码也可以 */
+    if(var->nonstd && var->nonstd != SSD1306_NONSTD_PAGE_MAJOR)
+        return -EINVAL;
+    page_major = var->nonstd == SSD1306_NONSTD_PAGE_MAJOR || var->grayscale == SSD1306_FOURCC_PAGE_MAJOR;
+    /* 页格式是单色控制器GDDRAM的格式,旋转了90/270度时对不上 */
+    if(page_major && (ssd1306->variant->bpp != 1 || ssd1306->rotate == 90 || ssd1306->rotate == 270))
+        return -EINVAL;
+
+    /* 分辨率和色深都是固定的,显存就是64行的GDDRAM,只能循环(ywrap)平移 */
+    var->xres = var->xres_virtual = info->var.xres;
+    var->yres = var->yres_virtual = info->var.yres;
+    var->xoffset = 0;
+    if(!(var->vmode & FB_VMODE_YWRAP) || var->yoffset >= var->yres_virtual || !ssd1306_can_ywrap(ssd1306))
+        var->yoffset = 0;
+    /* 单色屏可以选8位灰度的显存,页格式只有单色的 */
+    if(bpp == 1 && var->bits_per_pixel == 8 && !page_major)
+        bpp = 8;
+    ssd1306_set_bitfields(var,bpp);
+    var->nonstd = page_major ? SSD1306_NONSTD_PAGE_MAJOR : 0;
+    var->grayscale = page_major ? SSD1306_FOURCC_PAGE_MAJOR : bpp > 1;
+    return 0;
+}
+
+/* 
+ * 用Set Display Start Line(0x40|n)实现平移,显存不动,只发一个命令字节;
+ * fbcon会在原子上下文中调用这里,所以只记下起始行,交给工作队列去发送
+ */
+static int ssd1306_fb_pan_display(struct fb_var_screeninfo *var,struct fb_info *info)
+{
+    struct ssd1306_dev *ssd1306 = info->par;
+    unsigned long flags;
+
+    if(var->xoffset || var->yoffset >= info->var.yres_virtual)
+        return -EINVAL;
+    if(var->yoffset && !ssd1306_can_ywrap(ssd1306))
+        return -EINVAL;
+
+    spin_lock_irqsave(&ssd1306->lock,flags);
+    ssd1306->start_line = var->yoffset;
+    spin_unlock_irqrestore(&ssd1306->lock,flags);
+    ssd1306_schedule_flush(ssd1306);
+    return 0;
+}
+
+static int ssd1306_fb_set_par(struct fb_info *info)
+{
+    struct ssd1306_dev *ssd1306 = info->par;
+    bool page_major = info->var.nonstd == SSD1306_NONSTD_PAGE_MAJOR;
+    bool gray8 = info->var.bits_per_pixel > ssd1306->variant->bpp;
+    unsigned long flags;
+
+    if(page_major == ssd1306->page_major && gray8 == ssd1306->gray8)
         return 0;
+
+    /* 同一块显存换了一种解释方法,在写区间中切换,正在进行的转换会重来;整屏重新刷一遍 */
+    ssd1306_smem_write_begin(ssd1306,&flags);
+    ssd1306_set_format(ssd1306,page_major);
+    ssd1306_smem_write_end(ssd1306,flags);
+    ssd1306_damage_all(ssd1306);
+    ssd1306_schedule_flush(ssd1306);
+    return 0;
+}
+
+/* 修改最高刷新率,mmap的合并延迟也跟着变成一帧的时间 */
+static void ssd1306_set_target_fps(struct ssd1306_dev *ssd1306,unsigned int fps)
+{
+    ssd1306->target_fps = clamp_t(unsigned int,fps,1,1000);
+    ssd1306->defio.delay = msecs_to_jiffies(MSEC_PER_SEC / ssd1306->target_fps) ? : 1;
+}
+
+static ssize_t target_fps_show(struct device *dev,struct device_attribute *attr,char *buf)
+{
+    struct ssd1306_dev *ssd1306 = dev_get_drvdata(dev);
+
+    return sprintf(buf,"%u\n",ssd1306->target_fps);
+}
+
+static ssize_t target_fps_store(struct device *dev,struct device_attribute *attr,const char *buf,size_t count)
+{
+    struct ssd1306_dev *ssd1306 = dev_get_drvdata(dev);
+    unsigned int fps;
+    int ret;
+
+    ret = kstrtouint(buf,0,&fps);
+    if(ret)
+        return ret;
+    if(!fps)
+        return -EINVAL;
+
+    ssd1306_set_target_fps(ssd1306,fps);
+    return count;
+}
+static DEVICE_ATTR_RW(target_fps);
+
+static ssize_t actual_fps_show(struct device *dev,struct device_attribute *attr,char *buf)
+{
+    struct ssd1306_dev *ssd1306 = dev_get_drvdata(dev);
+    u64 now = ktime_get_ns();
+
+    /* 统计窗口之后再没有刷新过,说明屏是静止的 */
+    if(now - ssd1306->last_xfer_end > 2 * NSEC_PER_SEC)
+        return sprintf(buf,"0\n");
+    return sprintf(buf,"%u\n",ssd1306->achieved_fps);
+}
+static DEVICE_ATTR_RO(actual_fps);
+
+static ssize_t sync_write_show(struct device *dev,struct device_attribute *attr,char *buf)
+{
+    struct ssd1306_dev *ssd1306 = dev_get_drvdata(dev);
+
+    return sprintf(buf,"%d\n",ssd1306->sync_write);
+}
+
+static ssize_t sync_write_store(struct device *dev,struct device_attribute *attr,const char *buf,size_t count)
+{
+    struct ssd1306_dev *ssd1306 = dev_get_drvdata(dev);
+    bool val;
+    int ret;
+
+    ret = strtobool(buf,&val);
+    if(ret)
+        return ret;
+    ssd1306->sync_write = val;
+    return count;
+}
+static DEVICE_ATTR_RW(sync_write);
+
+static ssize_t manual_commit_show(struct device *dev,struct device_attribute *attr,char *buf)
+{
+    struct ssd1306_dev *ssd1306 = dev_get_drvdata(dev);
+
+    return sprintf(buf,"%d\n",ssd1306->manual_commit);
+}
+
+/* 关闭手动提交时,已经积攒的脏区马上刷新 */
+static ssize_t manual_commit_store(struct device *dev,struct device_attribute *attr,const char *buf,size_t count)
+{
+    struct ssd1306_dev *ssd1306 = dev_get_drvdata(dev);
+    bool val;
+    int ret;
+
+    ret = strtobool(buf,&val);
+    if(ret)
+        return ret;
+    ssd1306->manual_commit = val;
+    if(!val)
+        ssd1306_schedule_flush(ssd1306);
+    return count;
+}
+static DEVICE_ATTR_RW(manual_commit);
+
+static ssize_t fair_bus_show(struct device *dev,struct device_attribute *attr,char *buf)
+{
+    struct ssd1306_dev *ssd1306 = dev_get_drvdata(dev);
+
+    return sprintf(buf,"%d\n",ssd1306->fair_bus);
+}
+
+static ssize_t fair_bus_store(struct device *dev,struct device_attribute *attr,const char *buf,size_t count)
+{
+    struct ssd1306_dev *ssd1306 = dev_get_drvdata(dev);
+    bool val;
+    int ret;
+
+    ret = strtobool(buf,&val);
+    if(ret)
+        return ret;
+    ssd1306->fair_bus = val;
+    return count;
+}
+static DEVICE_ATTR_RW(fair_bus);
+
+static ssize_t bus_budget_us_show(struct device *dev,struct device_attribute *attr,char *buf)
+{
+    struct ssd1306_dev *ssd1306 = dev_get_drvdata(dev);
+
+    return sprintf(buf,"%u\n",ssd1306->bus_budget_us);
+}
+
+static ssize_t bus_budget_us_store(struct device *dev,struct device_attribute *attr,const char *buf,size_t count)
+{
+    struct ssd1306_dev *ssd1306 = dev_get_drvdata(dev);
+    unsigned int val;
+    int ret;
+
+    ret = kstrtouint(buf,0,&val);
+    if(ret)
+        return ret;
+    ssd1306->bus_budget_us = val;
+    return count;
+}
+static DEVICE_ATTR_RW(bus_budget_us);
+
+static const char * const ssd1306_dither_names[] = {
+    [SSD1306_DITHER_ORDERED]    = "ordered",
+    [SSD1306_DITHER_DIFFUSION]  = "diffusion",
+};
+
+static ssize_t dither_show(struct device *dev,struct device_attribute *attr,char *buf)
+{
+    struct ssd1306_dev *ssd1306 = dev_get_drvdata(dev);
+
+    return sprintf(buf,"%s\n",ssd1306_dither_names[ssd1306->dither]);
+}
+
+/* 换了抖动方法,8位灰度显存下整屏重新转换 */
+static ssize_t dither_store(struct device *dev,struct device_attribute *attr,const char *buf,size_t count)
+{
+    struct ssd1306_dev *ssd1306 = dev_get_drvdata(dev);
+    int i;
+
+    for(i = 0 ; i < ARRAY_SIZE(ssd1306_dither_names) ; i++){
+        if(sysfs_streq(buf,ssd1306_dither_names[i]))
+            break;
+    }
+    if(i == ARRAY_SIZE(ssd1306_dither_names))
+        return -EINVAL;
+    ssd1306->dither = i;
+    if(ssd1306->gray8){
+        ssd1306_damage_all(ssd1306);
+        ssd1306_schedule_flush(ssd1306);
     }
+    return count;
+}
+static DEVICE_ATTR_RW(dither);
 
-	if (vma->vm_pgoff > (~0UL >> PAGE_SHIFT))
-		return -EINVAL;
-	if (size > info->fix.smem_len)
-		return -EINVAL;
-	if (offset > info->fix.smem_len - size)
-		return -EINVAL;
+static ssize_t frames_flushed_show(struct device *dev,struct device_attribute *attr,char *buf)
+{
+    struct ssd1306_dev *ssd1306 = dev_get_drvdata(dev);
 
-	pos = (unsigned long)info->fix.smem_start + offset;
-    
-	while (size > 0) {
-		page = vmalloc_to_pfn((void *)pos);
-		if (remap_pfn_range(vma, start, page, PAGE_SIZE, PAGE_SHARED)) {
-			return -EAGAIN;
-		}
-		start += PAGE_SIZE;
-		pos += PAGE_SIZE;
-		if (size > PAGE_SIZE)
-			size -= PAGE_SIZE;
-		else
-			size = 0;
-	}
+    return sprintf(buf,"%lu\n",ssd1306->frames_flushed);
+}
+static DEVICE_ATTR_RO(frames_flushed);
 
-    ssd1306->timer.expires = jiffies + HZ;
-    add_timer(&ssd1306->timer); 
-    ssd1306->is_mapped = 1;
+static ssize_t frames_skipped_show(struct device *dev,struct device_attribute *attr,char *buf)
+{
+    struct ssd1306_dev *ssd1306 = dev_get_drvdata(dev);
 
-	return 0;
+    return sprintf(buf,"%lu\n",ssd1306->frames_skipped);
 }
+static DEVICE_ATTR_RO(frames_skipped);
+
+static struct attribute *ssd1306_attrs[] = {
+    &dev_attr_frames_flushed.attr,
+    &dev_attr_frames_skipped.attr,
+    &dev_attr_target_fps.attr,
+    &dev_attr_actual_fps.attr,
+    &dev_attr_sync_write.attr,
+    &dev_attr_manual_commit.attr,
+    &dev_attr_fair_bus.attr,
+    &dev_attr_bus_budget_us.attr,
+    &dev_attr_dither.attr,
+    NULL,
+};
+
+static const struct attribute_group ssd1306_attr_group = {
+    .attrs = ssd1306_attrs,
+};
+
+/* 
+ * 开始硬件滚动,之后每一步都由ssd1306自己完成,总线上不再有数据;
+ * vertical_offset不为0时为对角滚动.
+ * 先把还没刷新的内容刷到屏上,滚动的就是当前显存中的内容
+ */
+static int ssd1306_start_scroll(struct ssd1306_dev *ssd1306,const struct ssd1306_scroll *scroll)
+{
+    int height = ssd1306->variant->height;
+    int pages = height / 8;
+    u8 cmd_buf[16];
+    int len = 0;
+    int ret;
+
+    if(scroll->dir > SSD1306_SCROLL_LEFT || scroll->start_page > scroll->end_page ||
+       scroll->end_page >= pages || scroll->interval > 7 || scroll->vertical_offset >= height)
+        return -EINVAL;
+
+    mod_delayed_work(ssd1306->wqueue,&ssd1306->work,0);
+    flush_delayed_work(&ssd1306->work);
+
+    /* 所有命令一次发送 */
+    cmd_buf[len++] = CMD_DEACTIVATE_SCROLL;
+    if(scroll->vertical_offset){
+        cmd_buf[len++] = CMD_SET_VERTICAL_SCROLL_AREA;
+        cmd_buf[len++] = 0;
+        cmd_buf[len++] = height;
+        cmd_buf[len++] = scroll->dir == SSD1306_SCROLL_LEFT ? CMD_VERTICAL_LEFT_SCROLL : CMD_VERTICAL_RIGHT_SCROLL;
+    }else{
+        cmd_buf[len++] = scroll->dir == SSD1306_SCROLL_LEFT ? CMD_LEFT_SCROLL : CMD_RIGHT_SCROLL;
+    }
+    cmd_buf[len++] = 0x00;
+    cmd_buf[len++] = scroll->start_page;
+    cmd_buf[len++] = scroll->interval;
+    cmd_buf[len++] = scroll->end_page;
+    if(scroll->vertical_offset){
+        cmd_buf[len++] = scroll->vertical_offset;
+    }else{
+        cmd_buf[len++] = 0x00;
+        cmd_buf[len++] = 0xff;
+    }
+    cmd_buf[len++] = CMD_ACTIVATE_SCROLL;
+
+    mutex_lock(&ssd1306->io_lock);
+    ret = ssd1306_write_cmd(ssd1306,cmd_buf,len);
+    if(!ret){
+        ssd1306->scrolling = true;
+        ssd1306->shadow_stale = true;
+    }
+    mutex_unlock(&ssd1306->io_lock);
+    return ret;
+}
+
+/* 停止滚动,并把显存中的内容整屏重发一遍,恢复滚动前的画面 */
+static int ssd1306_stop_scroll(struct ssd1306_dev *ssd1306)
+{
+    int ret = 0;
+
+    mutex_lock(&ssd1306->io_lock);
+    if(ssd1306->scrolling)
+        ret = ssd1306_stop_scroll_locked(ssd1306);
+    mutex_unlock(&ssd1306->io_lock);
+    if(ret)
+        return ret;
+
+    ssd1306_damage_all(ssd1306);
+    ssd1306_schedule_flush(ssd1306);
+    return 0;
+}
+
+/* 
+ * 刷新栅栏分成两步,拼接屏先在所有的屏上开始,再逐个等待,各屏的刷新可以同时进行;
+ * 返回的序号交给ssd1306_fence_wait
+ */
+u32 ssd1306_fence_begin(struct ssd1306_dev *ssd1306)
+{
+    unsigned long flags;
+    u32 fence;
 
-struct fb_ops ssd1306_fbops = {
+    spin_lock_irqsave(&ssd1306->lock,flags);
+    fence = ++ssd1306->fence_req;
+    spin_unlock_irqrestore(&ssd1306->lock,flags);
+
+    flush_delayed_work(&ssd1306->info->deferred_work);
+    mod_delayed_work(ssd1306->wqueue,&ssd1306->work,0);
+    return fence;
+}
+
+int ssd1306_fence_wait(struct ssd1306_dev *ssd1306,u32 fence,u64 *stamp)
+{
+    long ret;
+
+    ret = wait_event_interruptible_timeout(ssd1306->fence_wait,
+                                           (s32)(ssd1306->fence_done - fence) >= 0 || ssd1306->removed,1 * HZ);
+    if(ssd1306->removed){
+        return -ENODEV;
+    }else if(!ret){
+        dev_err(ssd1306->dev,"wait for flush failed!\n");
+        return -ETIME;
+    }else if(ret < 0){
+        return ret;
+    }
+
+    *stamp = ssd1306->last_xfer_end;
+    return 0;
+}
+
+static int ssd1306_flush_fence(struct ssd1306_dev *ssd1306,u64 *stamp)
+{
+    return ssd1306_fence_wait(ssd1306,ssd1306_fence_begin(ssd1306),stamp);
+}
+
+static int ssd1306_fb_ioctl(struct fb_info *info,unsigned int cmd,unsigned long arg)
+{
+    struct ssd1306_dev *ssd1306 = info->par;
+    struct ssd1306_scroll scroll;
+    int ret = -EINVAL;
+    u64 stamp;
+
+    switch(cmd){
+        case SSD1306_IOC_START_SCROLL:
+            if(!ssd1306->variant->hw_scroll)
+                return -ENOTTY;
+            if(copy_from_user(&scroll,(void __user *)arg,sizeof(scroll)))
+                return -EFAULT;
+            ret = ssd1306_start_scroll(ssd1306,&scroll);
+            return ret;
+        case SSD1306_IOC_STOP_SCROLL:
+            if(!ssd1306->variant->hw_scroll)
+                return -ENOTTY;
+            ret = ssd1306_stop_scroll(ssd1306);
+            return ret;
+        case SSD1306_IOC_FLUSH:
+            ret = ssd1306_flush_fence(ssd1306,&stamp);
+            if(ret)
+                return ret;
+            if(copy_to_user((void __user *)arg,&stamp,sizeof(stamp)))
+                return -EFAULT;
+            return 0;
+        default:
+            break;
+    }
+    return ret;
+}
+
+/* 
+ * 释放remove之后还可能被用到的部分:fb_info和跟在后面的ssd1306_dev,显存,工作队列;
+ * 注册了framebuffer时由fb核心在最后一个用户关闭后调用,拼接屏的成员在remove中直接调用
+ */
+static void ssd1306_fb_destroy(struct fb_info *info)
+{
+    struct ssd1306_dev *ssd1306 = info->par;
+
+    fb_deferred_io_cleanup(info);
+    destroy_workqueue(ssd1306->wqueue);
+    vfree(ssd1306->video_mem);
+    framebuffer_release(info);
+}
+
+/* 
+ * 只是模板,probe时拷贝到每块屏自己的fbops中:fb_deferred_io_cleanup会把fb_mmap清成NULL,
+ * 共用一份时移除一块屏,其他屏的mmap就退回到把smem_start当物理地址映射了
+ */
+static const struct fb_ops ssd1306_fbops = {
     .owner          = THIS_MODULE,
     .fb_open        = ssd1306_fb_open,
     .fb_release     = ssd1306_fb_release,
+    .fb_check_var   = ssd1306_fb_check_var,
+    .fb_set_par     = ssd1306_fb_set_par,
     .fb_write       = ssd1306_fb_write,
-    .fb_mmap        = ssd1306_fb_mmap,
-    .fb_fillrect	= cfb_fillrect,
-	.fb_copyarea	= cfb_copyarea,
-	.fb_imageblit	= cfb_imageblit,
+    .fb_ioctl       = ssd1306_fb_ioctl,
+    .fb_pan_display = ssd1306_fb_pan_display,
+    .fb_destroy     = ssd1306_fb_destroy,
+    .fb_fillrect	= ssd1306_fillrect,
+	.fb_copyarea	= ssd1306_copyarea,
+	.fb_imageblit	= ssd1306_imageblit,
+};
+
+#ifdef CONFIG_DEBUG_FS
+static void ssd1306_hist_show(struct seq_file *m,const char *name,const unsigned long *hist)
+{
+    int i;
+
+    seq_printf(m,"%s (us):\n",name);
+    for(i = 0 ; i < SSD_HIST_BUCKETS ; i++){
+        if(i == SSD_HIST_BUCKETS - 1)
+            seq_printf(m,"  %8u+        : %lu\n",1u << i,hist[i]);
+        else
+            seq_printf(m,"  %8u-%-8u: %lu\n",i ? 1u << i : 0,(1u << (i + 1)) - 1,hist[i]);
+    }
+}
+
+static int ssd1306_stats_show(struct seq_file *m,void *v)
+{
+    struct ssd1306_dev *ssd1306 = m->private;
+    struct ssd1306_stats *stats = &ssd1306->stats;
+
+    seq_printf(m,"frames_flushed: %lu\n",ssd1306->frames_flushed);
+    seq_printf(m,"frames_skipped: %lu\n",ssd1306->frames_skipped);
+    seq_printf(m,"bytes_sent: %lu\n",stats->bytes_sent);
+    seq_printf(m,"retries: %lu\n",stats->retries);
+    seq_printf(m,"errors: %lu\n",stats->errors);
+    seq_printf(m,"glyph_hits: %lu\n",stats->glyph_hits);
+    seq_printf(m,"glyph_misses: %lu\n",stats->glyph_misses);
+    seq_printf(m,"budget_cuts: %lu\n",stats->budget_cuts);
+    ssd1306_hist_show(m,"bus time",stats->xfer_hist);
+    ssd1306_hist_show(m,"flush interval",stats->interval_hist);
+    return 0;
+}
+
+static int ssd1306_stats_open(struct inode *inode,struct file *file)
+{
+    return single_open(file,ssd1306_stats_show,inode->i_private);
+}
+
+static const struct file_operations ssd1306_stats_fops = {
+    .owner          = THIS_MODULE,
+    .open           = ssd1306_stats_open,
+    .read           = seq_read,
+    .llseek         = seq_lseek,
+    .release        = single_release,
 };
 
-static int ssd1306_probe(struct i2c_client *client,const struct i2c_device_id *id)
+/* 每块屏一个目录,debugfs出错不影响驱动工作,不检查返回值 */
+static void ssd1306_debugfs_init(struct ssd1306_dev *ssd1306)
+{
+    if(!ssd1306_debugfs_root)
+        return;
+    ssd1306->debugfs = debugfs_create_dir(dev_name(ssd1306->dev),ssd1306_debugfs_root);
+    debugfs_create_file("stats",0444,ssd1306->debugfs,ssd1306,&ssd1306_stats_fops);
+}
+
+static void ssd1306_debugfs_exit(struct ssd1306_dev *ssd1306)
+{
+    debugfs_remove_recursive(ssd1306->debugfs);
+}
+#else
+static inline void ssd1306_debugfs_init(struct ssd1306_dev *ssd1306) {}
+static inline void ssd1306_debugfs_exit(struct ssd1306_dev *ssd1306) {}
+#endif
+
+/* 
+ * 设备树中有init-seq属性时使用它,否则使用控制器默认的初始化序列;
+ * 参数按数据发送的控制器(SSD1322),init-seq也要按{命令,参数个数,参数...}编码
+ */
+static int ssd1306_get_init_seq(struct ssd1306_dev *ssd1306)
+{
+    struct device *dev = ssd1306->dev;
+    u8 *seq;
+    int len;
+
+    len = of_property_count_u8_elems(dev->of_node,"init-seq");
+    if(len <= 0){
+        ssd1306->init_seq = ssd1306->variant->init_seq;
+        ssd1306->init_seq_len = ssd1306->variant->init_seq_len;
+        return 0;
+    }
+    if(!ssd1306->variant->args_as_data && len > SSD_CMD_BUF_SIZE - 1){
+        dev_err(dev,"init-seq too long: %d bytes, at most %d\n",len,SSD_CMD_BUF_SIZE - 1);
+        return -EINVAL;
+    }
+
+    seq = devm_kzalloc(dev,len,GFP_KERNEL);
+    if(!seq)
+        return -ENOMEM;
+    of_property_read_u8_array(dev->of_node,"init-seq",seq,len);
+    ssd1306->init_seq = seq;
+    ssd1306->init_seq_len = len;
+    return 0;
+}
+
+/* 
+ * 设备树中的rotate属性给出显存相对于屏顺时针旋转的角度,竖着装的屏用90或270;
+ * 90/270度在转换时完成,只支持单色屏,180度由控制器反向扫描完成
+ */
+static int ssd1306_get_rotate(struct ssd1306_dev *ssd1306)
+{
+    const struct ssd1306_variant *variant = ssd1306->variant;
+    u32 rotate = 0;
+
+    of_property_read_u32(ssd1306->dev->of_node,"rotate",&rotate);
+    if((rotate == 90 || rotate == 270) && variant->bpp == 1)
+        ssd1306->rotate = rotate;
+    else if(rotate == 180 && variant->flip_seq)
+        ssd1306->rotate = rotate;
+    else if(rotate){
+        dev_err(ssd1306->dev,"%s does not support rotate = %u\n",variant->name,rotate);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* 所有probe成功的屏,拼接屏按设备树节点在这里查找成员 */
+static LIST_HEAD(ssd1306_list);
+static DEFINE_MUTEX(ssd1306_list_lock);
+
+/* 
+ * 拼接屏按设备树节点找到成员屏并占用,一块屏只能属于一个拼接屏;
+ * 还没有probe时返回-EPROBE_DEFER.成员屏移除时会先解除拼接屏的绑定,见ssd1306_core_remove
+ */
+int ssd1306_core_claim(struct device_node *np,struct device *owner,struct ssd1306_dev **out)
 {
+    struct ssd1306_dev *ssd1306;
+    int ret = -EPROBE_DEFER;
+
+    mutex_lock(&ssd1306_list_lock);
+    list_for_each_entry(ssd1306,&ssd1306_list,node){
+        if(ssd1306->dev->of_node != np)
+            continue;
+        if(ssd1306->tile_owner){
+            ret = -EBUSY;
+        }else{
+            ssd1306->tile_owner = owner;
+            *out = ssd1306;
+            ret = 0;
+        }
+        break;
+    }
+    mutex_unlock(&ssd1306_list_lock);
+    return ret;
+}
+
+/* 拼接屏移除或probe失败时放开成员屏 */
+void ssd1306_core_unclaim(struct ssd1306_dev *ssd1306)
+{
+    mutex_lock(&ssd1306_list_lock);
+    ssd1306->tile_owner = NULL;
+    mutex_unlock(&ssd1306_list_lock);
+}
+
+/* 
+ * 分配fb_info和跟在后面的ssd1306_dev,由总线的probe调用,之后填好总线相关的成员;
+ * variant由总线驱动根据设备树或设备id选出
+ */
+struct ssd1306_dev *ssd1306_core_alloc(struct device *dev,const struct ssd1306_ops *ops,
+                                      const struct ssd1306_variant *variant)
+{
+    struct ssd1306_dev *ssd1306;
     struct fb_info *info;
-    int ret = -ENOMEM;
-    
-    if(!(video_mem = rvmalloc(video_mem_size)))
-        return ret;
 
-    info = framebuffer_alloc(0,&client->dev);
+    info = framebuffer_alloc(sizeof(struct ssd1306_dev),dev);
     if(!info)
-        goto err;
-    ssd1306_dev.info = info;
-    info->par = &ssd1306_dev;
-    ssd1306_dev.client = client;
+        return NULL;
+    ssd1306 = info->par;
+    ssd1306->info = info;
+    ssd1306->dev = dev;
+    ssd1306->ops = ops;
+    ssd1306->variant = variant;
+    return ssd1306;
+}
+
+/* 
+ * 与总线无关的部分:分配显存和缓冲区,初始化屏并注册framebuffer;
+ * 失败时连同ssd1306_core_alloc分配的fb_info一起释放
+ */
+int ssd1306_core_probe(struct ssd1306_dev *ssd1306)
+{
+    const struct ssd1306_variant *variant = ssd1306->variant;
+    struct device *dev = ssd1306->dev;
+    struct fb_info *info = ssd1306->info;
+    int ret = -ENOMEM;
+    u32 screen_size = variant->width * variant->height * variant->bpp / 8;
+    u32 smem_size = screen_size;
+    const char *dither;
+    bool gray8 = false;
+    u32 fps;
+
+    ret = ssd1306_get_rotate(ssd1306);
+    if(ret)
+        goto err_release;
+    ret = -ENOMEM;
+
+    /* 
+     * fb_deferred_io要靠缺页把这些页映射给用户,不能再标记为保留页;
+     * 按页分配,一页最小,反正最后会被延长到整页.单色屏可以切换到8位灰度的显存,按大的分配
+     */
+    if(variant->bpp == 1)
+        smem_size = variant->width * variant->height;
+    ssd1306->video_mem = vzalloc(PAGE_ALIGN(smem_size));
+    if(!ssd1306->video_mem)
+        goto err_release;
+
+    /* 影子初始为0,与ssd1306_clear之后屏上的内容一致 */
+    ssd1306->shadow = devm_kzalloc(dev,screen_size,GFP_KERNEL);
+    if(!ssd1306->shadow)
+        goto err_vfree;
+
+    /* kmalloc的内存物理连续,可以用于DMA,不能放在栈上或用vmalloc */
+    ssd1306->tx_buf = devm_kzalloc(dev,SSD_FRAME_HEADROOM + screen_size,GFP_KERNEL);
+    ssd1306->cmd_buf = devm_kzalloc(dev,SSD_CMD_BUF_SIZE,GFP_KERNEL);
+    if(!ssd1306->tx_buf || !ssd1306->cmd_buf)
+        goto err_vfree;
+    ssd1306->frame = ssd1306->tx_buf + SSD_FRAME_HEADROOM;
+    mutex_init(&ssd1306->io_lock);
+
+    ssd1306->write_buf = devm_kmalloc(dev,smem_size,GFP_KERNEL);
+    if(!ssd1306->write_buf)
+        goto err_vfree;
+    mutex_init(&ssd1306->write_lock);
+
+    /* 单色屏给控制台文字准备页格式的副本和字形缓存 */
+    if(variant->bpp == 1){
+        ssd1306->native = devm_kzalloc(dev,screen_size,GFP_KERNEL);
+        ssd1306->glyphs = devm_kcalloc(dev,SSD_GLYPH_CACHE_SIZE,sizeof(struct ssd1306_glyph),GFP_KERNEL);
+        ssd1306->dither_err = devm_kcalloc(dev,2 * (variant->width + 2),sizeof(s16),GFP_KERNEL);
+        if(!ssd1306->native || !ssd1306->glyphs || !ssd1306->dither_err)
+            goto err_vfree;
+        gray8 = of_property_read_bool(dev->of_node,"gray8");
+        if(!of_property_read_string(dev->of_node,"dither",&dither) && !strcmp(dither,"diffusion"))
+            ssd1306->dither = SSD1306_DITHER_DIFFUSION;
+    }
     
     /* 设置fix参数 */
     strcpy(info->fix.id,"my oled");
-    info->fix.smem_start = (unsigned long)video_mem;
-    info->fix.smem_len   = video_mem_size;
-    info->fix.type       = FB_TYPE_PACKED_PIXELS;
-    info->fix.visual     = FB_VISUAL_MONO10;
-    info->fix.line_length = 128 / 8;
+    info->fix.smem_start = (unsigned long)ssd1306->video_mem;
+    info->fix.smem_len   = PAGE_ALIGN(smem_size);
     
-    /* 设置var参数 */
-    info->var.xres = 128;
-    info->var.yres = 64;
-    info->var.bits_per_pixel = 1;
+    /* 设置var参数,分辨率和色深由控制器决定,旋转90/270度时宽高互换 */
+    if(ssd1306->rotate == 90 || ssd1306->rotate == 270){
+        info->var.xres = variant->height;
+        info->var.yres = variant->width;
+    }else{
+        info->var.xres = variant->width;
+        info->var.yres = variant->height;
+    }
+    info->var.xres_virtual = info->var.xres;
+    info->var.yres_virtual = info->var.yres;
+    ssd1306_set_bitfields(&info->var,gray8 ? 8 : variant->bpp);
     info->var.activate = FB_ACTIVATE_NXTOPEN;
+    info->var.vmode = FB_VMODE_NONINTERLACED;
+    /* 起始行可以是0~63中任意一行,超出的部分从GDDRAM开头接上 */
+    if(ssd1306_can_ywrap(ssd1306))
+        info->fix.ywrapstep = 1;
+    ssd1306->page_bytes = variant->width * variant->bpp;
+
+    /* 
+     * 默认是行格式,没有旋转的单色屏在设备树中有page-major属性时直接使用oled的页格式;
+     * 有gray8属性时一开始就是8位灰度的显存.screen_size在这里设置
+     */
+    ssd1306_set_format(ssd1306,variant->bpp == 1 && !gray8 && (ssd1306->rotate == 0 || ssd1306->rotate == 180) &&
+                       of_property_read_bool(dev->of_node,"page-major"));
     
      /* 设置info */
-    info->screen_base = (void *__iomem)video_mem;
-    /* 这里保存的是用到的显存的实际大小 */
-    info->screen_size = info->fix.line_length * info->var.yres;
+    info->screen_base = (void *__iomem)ssd1306->video_mem;
 
     /* 设置操作函数 */
-    info->fbops = &ssd1306_fbops;
+    ssd1306->fbops = ssd1306_fbops;
+    info->fbops = &ssd1306->fbops;
+    info->flags = FBINFO_DEFAULT | FBINFO_VIRTFB;
+    if(ssd1306_can_ywrap(ssd1306))
+        info->flags |= FBINFO_HWACCEL_YWRAP;
     
-    /* 注册 */
-    ret = register_framebuffer(info);
-    if(ret < 0){
-        goto err1;
+    /* 
+     * 每块屏一个工作队列,不同总线上的屏可以同时刷新;
+     * 注册之后fbcon可能马上就开始画图,所以工作队列要在注册前准备好
+     */
+    ssd1306->wqueue = alloc_ordered_workqueue("ssd1306-%s",WQ_MEM_RECLAIM,dev_name(dev));
+    if(!ssd1306->wqueue){
+        dev_err(dev,"create workqueue failed!\n");
+        goto err_vfree;
     }
-    
-    i2c_set_clientdata(client,&ssd1306_dev);
-    
-    ssd1306_dev.wqueue = create_singlethread_workqueue("ssd1306_wqueue");
-    if(!ssd1306_dev.wqueue){
-        printk("create workqueue failed!\n");
-        goto err1;
+    spin_lock_init(&ssd1306->lock);
+    seqcount_init(&ssd1306->smem_seq);
+
+    INIT_DELAYED_WORK(&ssd1306->work,ssd1306_work_func);
+    init_waitqueue_head(&ssd1306->fence_wait);
+
+    /* 
+     * mmap由fb_deferred_io接管,只有写过的页才会在延迟之后触发刷新,
+     * 延迟为一帧的时间,给用户程序留出画完一帧的时间
+     */
+    fps = max_fps;
+    of_property_read_u32(dev->of_node,"max-fps",&fps);
+    ssd1306->backoff = 1;
+    ssd1306_set_target_fps(ssd1306,fps);
+
+    /* 与温度,电源等传感器共用i2c总线时,用fair-bus和bus-budget-us限制刷新对总线的占用 */
+    ssd1306->fair_bus = of_property_read_bool(dev->of_node,"fair-bus");
+    of_property_read_u32(dev->of_node,"bus-budget-us",&ssd1306->bus_budget_us);
+
+    ret = ssd1306_get_init_seq(ssd1306);
+    if(ret)
+        goto err_wq;
+    ssd1306->defio.deferred_io = ssd1306_deferred_io;
+    info->fbdefio = &ssd1306->defio;
+    fb_deferred_io_init(info);
+
+    /* 注册前初始化并清屏,与全0的影子一致;初始化失败也照样注册,屏可能稍后才上电 */
+    if(ssd1306->ops->hw_init)
+        ssd1306->ops->hw_init(ssd1306);
+    else
+        ssd1306_dev_init(ssd1306);
+    ssd1306_clear(ssd1306);
+
+    /* 拼接屏中的一块不单独注册framebuffer,只通过ssd1306_tiled访问 */
+    ssd1306->tile_member = of_property_read_bool(dev->of_node,"tile-member");
+    if(!ssd1306->tile_member){
+        ret = register_framebuffer(info);
+        if(ret < 0){
+            goto err_defio;
+        }
     }
-    ssd1306_dev_init(client);
-    return 0;
-err1:
-    unregister_framebuffer(info);
-err:
-    rvfree(video_mem,video_mem_size);
+    
+    ret = sysfs_create_group(&dev->kobj,&ssd1306_attr_group);
+    if(ret)
+        dev_err(dev,"create sysfs attributes failed!\n");
+    ssd1306_debugfs_init(ssd1306);
+
+    mutex_lock(&ssd1306_list_lock);
+    list_add_tail(&ssd1306->node,&ssd1306_list);
+    mutex_unlock(&ssd1306_list_lock);
+    if(ssd1306->tile_member)
+        ssd1306_tiled_rescan();
     return 0;
+err_defio:
+    fb_deferred_io_cleanup(info);
+err_wq:
+    destroy_workqueue(ssd1306->wqueue);
+err_vfree:
+    vfree(ssd1306->video_mem);
+err_release:
+    framebuffer_release(info);
+    return ret;
 }
 
-static int ssd1306_remove(struct i2c_client *client)
+int ssd1306_core_remove(struct ssd1306_dev *ssd1306)
 {   
-    struct ssd1306_dev *ssd1306;
-    struct fb_info *info;
+    struct fb_info *info = ssd1306->info;
+    struct device *owner;
+    unsigned long flags;
+
+    /* 
+     * 先从链表中拿掉,拼接屏不会再找到这块屏;属于某个拼接屏时先解除它的绑定,
+     * 拼接屏的remove会放开所有成员,之后不会再往这块屏拷贝或者等待它的刷新
+     */
+    mutex_lock(&ssd1306_list_lock);
+    list_del(&ssd1306->node);
+    owner = ssd1306->tile_owner;
+    if(owner)
+        get_device(owner);
+    mutex_unlock(&ssd1306_list_lock);
+    if(owner){
+        device_release_driver(owner);
+        put_device(owner);
+    }
 
-    ssd1306_dev_exit(client);
-    ssd1306 = i2c_get_clientdata(client);
-    info = ssd1306->info;
-    if(info){
-        rvfree(video_mem,video_mem_size);
+    ssd1306_debugfs_exit(ssd1306);
+    sysfs_remove_group(&ssd1306->dev->kobj,&ssd1306_attr_group);
+
+    /* 
+     * devm分配的缓冲区在返回后就释放了,之后的刷新什么都不做;
+     * 取消还没到时间的刷新,等正在进行的刷新结束,还在等栅栏的返回-ENODEV
+     */
+    spin_lock_irqsave(&ssd1306->lock,flags);
+    ssd1306->removed = true;
+    spin_unlock_irqrestore(&ssd1306->lock,flags);
+    wake_up_interruptible_all(&ssd1306->fence_wait);
+    cancel_delayed_work_sync(&ssd1306->work);
+    ssd1306_dev_exit(ssd1306);
+
+    /* 
+     * fb可能还被打开或者映射着,info和ssd1306_dev留到ssd1306_fb_destroy中释放,
+     * 没有人打开时注销过程中就会调用,之后不能再访问ssd1306;
+     * 拼接屏的成员没有注册,拼接屏已经解除绑定,直接释放
+     */
+    if(ssd1306->tile_member)
+        ssd1306_fb_destroy(info);
+    else
         unregister_framebuffer(info);
-        framebuffer_release(info);
-    }
-    del_timer(&ssd1306->timer);
-    destroy_workqueue(ssd1306->wqueue);
     return 0;
 }
 
-static const struct of_device_id ssd1306_of_match_table[] = {
-    {
-        .compatible = "ssd1306",
-    },
-    {}
-};
-
-static const struct i2c_device_id ssd1306_id_table[] = {
-    {"ssd1306",0},
-    {}
-};
-
-static struct i2c_driver ssd1306_driver = {
-    .driver = {
-        .name = "ssd1306_i2c_driver",
-        .of_match_table = ssd1306_of_match_table,
-        .owner = THIS_MODULE,
-    },
-    .probe = ssd1306_probe,
-    .remove = ssd1306_remove,
-    .id_table = ssd1306_id_table,
-};
-
 static int __init ssd1306_init(void)
 {
+    int ret;
+
     // printk("enter %s\n",__func__);
-    i2c_add_driver(&ssd1306_driver);
+    ret = ssd1306_transpose_init();
+    if(ret)
+        return ret;
+    /* 没有打开debugfs时返回错误指针或NULL,这时就不创建统计文件了 */
+    ssd1306_debugfs_root = debugfs_create_dir("ssd1306",NULL);
+    if(IS_ERR(ssd1306_debugfs_root))
+        ssd1306_debugfs_root = NULL;
+    ret = ssd1306_i2c_register();
+    if(ret)
+        goto err;
+    ret = ssd1306_spi_register();
+    if(ret){
+        ssd1306_i2c_unregister();
+        goto err;
+    }
+    ret = ssd1306_tiled_register();
+    if(ret){
+        ssd1306_spi_unregister();
+        ssd1306_i2c_unregister();
+        goto err;
+    }
     return 0;
+err:
+    debugfs_remove_recursive(ssd1306_debugfs_root);
+    return ret;
 }
 
 static void __exit ssd1306_exit(void)
 {   
-    i2c_del_driver(&ssd1306_driver);
+    ssd1306_tiled_unregister();
+    ssd1306_spi_unregister();
+    ssd1306_i2c_unregister();
+    debugfs_remove_recursive(ssd1306_debugfs_root);
 }
 
 module_init(ssd1306_init);
@@ -1,6 +1,9 @@
 #ifndef __SSD1306_OLED_H
 #define __SSD1306_OLED_H
 
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
 /* 为命令定义一个易记的宏 */
 #define __ssd_cmd(_fixed,_offset,_var) ((_fixed) << _offset)
 
@@ -9,11 +12,297 @@
 #define CMD_INVERT_DISPLAY(_arg) (0xa6 & (_arg & 0x01))
 #define CMD_DISPLAY_ON(_arg) (0xae & (_arg & 0x01))
 
-#define CMD_SET_LOW_COL_ADDR(_arg) (0x0 & (_arg & 0xf))
-#define CMD_SET_HIGH_COL_ADDR(_arg) (0x1 & (_arg & 0xf))
+#define CMD_SET_LOW_COL_ADDR(_arg) (0x00 | ((_arg) & 0x0f))
+#define CMD_SET_HIGH_COL_ADDR(_arg) (0x10 | ((_arg) & 0x0f))
+#define CMD_SET_PAGE_START(_arg) (0xb0 | ((_arg) & 0x07))     /* 页地址模式下的起始页 */
 #define CMD_SET_ADDR_MODE (0x20)
 #define CMD_SET_COL_ADDR (0x21)
 #define CMD_SET_PAGE_ADDR (0x22)
+#define CMD_SET_START_LINE(_arg) (0x40 | ((_arg) & 0x3f))
+
+/* 滚动命令 */
+#define CMD_RIGHT_SCROLL (0x26)
+#define CMD_LEFT_SCROLL (0x27)
+#define CMD_VERTICAL_RIGHT_SCROLL (0x29)
+#define CMD_VERTICAL_LEFT_SCROLL (0x2a)
+#define CMD_DEACTIVATE_SCROLL (0x2e)
+#define CMD_ACTIVATE_SCROLL (0x2f)
+#define CMD_SET_VERTICAL_SCROLL_AREA (0xa3)
+
+/* 
+ * 页格式的显存:与ssd1306的显存(GDDRAM)一致,一个字节对应纵向8个点,低位在上,
+ * 每页(8行)xres个字节,fix.line_length即一页的字节数,各页依次存放,驱动直接发送不做转换.
+ * 将var.nonstd设为SSD1306_NONSTD_PAGE_MAJOR(或按FOURCC的约定将var.grayscale设为
+ * SSD1306_FOURCC_PAGE_MAJOR)即可切换到该格式,切换后fix.type/fix.visual分别为
+ * FB_TYPE_FOURCC/FB_VISUAL_FOURCC,var.grayscale为SSD1306_FOURCC_PAGE_MAJOR
+ */
+#define SSD1306_NONSTD_PAGE_MAJOR (1)
+/* 
+ * 单色屏也可以把var.bits_per_pixel设为8,显存变为每点一个字节的灰度(fix.visual为
+ * FB_VISUAL_STATIC_PSEUDOCOLOR),刷新时由驱动抖动成单色,抖动方法见sysfs中的dither
+ */
+#define SSD1306_FOURCC_PAGE_MAJOR ('S' | ('D' << 8) | ('P' << 16) | ('M' << 24))
+
+/* 
+ * 硬件滚动:start_page~end_page这几页由ssd1306自己循环滚动,每interval(命令中的编码,0~7)
+ * 滚动一列,vertical_offset不为0时每一步同时向上滚动vertical_offset行(对角滚动).
+ * 滚动过程中对显存的任何修改都会先停止滚动,再整屏重新发送
+ */
+#define SSD1306_SCROLL_RIGHT (0)
+#define SSD1306_SCROLL_LEFT (1)
+
+struct ssd1306_scroll
+{
+    __u32 dir;
+    __u32 start_page;
+    __u32 end_page;
+    __u32 interval;
+    __u32 vertical_offset;
+};
+
+#define SSD1306_IOC_START_SCROLL    _IOW('F',0x40,struct ssd1306_scroll)
+#define SSD1306_IOC_STOP_SCROLL     _IO('F',0x41)
+
+/* 
+ * 刷新栅栏:立即刷新并等待数据发送完成,与TFTLCD_WAIT_FOR_VSYNC类似,最多等1秒;
+ * 返回最近一次数据发送完成的时间(CLOCK_MONOTONIC,单位ns),在这之前写入显存的内容都已经在屏上了.
+ * 通过mmap画图时,驱动不知道一帧什么时候画完,可以把sysfs中的manual_commit设为1,
+ * 映射的显存被写过后不再自动刷新,画完一帧后调用这个ioctl提交,屏上不会出现画了一半的帧
+ */
+#define SSD1306_IOC_FLUSH           _IOR('F',0x42,__u64)
+
+#ifdef __KERNEL__
+/* 以下是驱动内部使用的 */
+#include <linux/fb.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/of.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+
+#define SSD_MAX_PAGES (8)           /* 显存最多8页,每页8行 */
+#define SSD_DEFAULT_FPS (60)        /* 默认的最高刷新率 */
+#define SSD_TX_HEADROOM (1)         /* 发送缓冲区中帧数据前面留给控制字节的空间 */
+#define SSD_FRAME_HEADROOM (1 + 2 * SSD_WINDOW_CMD_MAX)   /* 整帧前面的空间,i2c单次写入时放带控制字节的开窗口命令 */
+#define SSD_CMD_BUF_SIZE (64)       /* 一次最多发送的命令字节数(含控制字节) */
+#define SSD_WINDOW_CMD_MAX (16)     /* 开窗口的命令最多的字节数 */
+#define SSD_GLYPH_CACHE_SIZE (256)  /* 字形缓存的项数,按内容散列,直接映射 */
+#define SSD_GLYPH_MAX_HEIGHT (32)   /* 缓存的字形最高32行 */
+#define SSD_HIST_BUCKETS (20)       /* 直方图第n格统计[2^n,2^(n+1))us,第0格包括不到1us的,最后一格包括所有更长的 */
+
+/* 刷新统计,在debugfs的ssd1306/<设备名>/stats中查看 */
+struct ssd1306_stats
+{
+    unsigned long bytes_sent;           /* 发送的像素数据字节数,不含命令 */
+    unsigned long retries;              /* 总线传输失败后的重试次数 */
+    unsigned long errors;               /* 重试之后仍然失败的窗口数 */
+    unsigned long glyph_hits;           /* 控制台文字在字形缓存中找到的单元数 */
+    unsigned long glyph_misses;
+    unsigned long budget_cuts;          /* 超出总线预算,剩下的页留到下一次的刷新次数 */
+    unsigned long xfer_hist[SSD_HIST_BUCKETS];      /* 每次刷新在总线上花的时间 */
+    unsigned long interval_hist[SSD_HIST_BUCKETS];  /* 相邻两次刷新开始的间隔 */
+};
+
+struct ssd1306_dev;
+
+/* 字形缓存中的一项:一个8点宽的单元,同时保存行格式和预先转换好的页格式 */
+struct ssd1306_glyph
+{
+    u8 height;                          /* 0表示空 */
+    u8 bits[SSD_GLYPH_MAX_HEIGHT];      /* 行格式,一行一个字节,前景/背景色已经处理过 */
+    u8 native[SSD_GLYPH_MAX_HEIGHT];    /* 页格式,每页8个字节 */
+};
+
+/* 
+ * 总线操作,i2c和spi各实现一份;buf都位于kmalloc分配的缓冲区中,
+ * 前面留有SSD_TX_HEADROOM个字节可以临时借用,调用时已持有io_lock
+ */
+struct ssd1306_ops
+{
+    int (*hw_init)(struct ssd1306_dev *ssd1306);    /* 可选,做完总线相关的准备后调用ssd1306_dev_init */
+    int (*write_cmd)(struct ssd1306_dev *ssd1306,u8 *buf,int len);
+    int (*write_data)(struct ssd1306_dev *ssd1306,u8 *buf,int len);
+    /* 可选,开窗口并写入数据,没有时用write_cmd和write_data分两次完成 */
+    int (*write_window)(struct ssd1306_dev *ssd1306,int page_start,int page_end,
+                        int col_start,int col_end,u8 *buf,int len);
+};
+
+/* 8位灰度显存抖动成单色的方法 */
+enum ssd1306_dither
+{
+    SSD1306_DITHER_ORDERED,             /* 8x8 Bayer矩阵,每个点单独比较,可以只转换脏区 */
+    SSD1306_DITHER_DIFFUSION,           /* Floyd-Steinberg误差扩散,效果更好,每次都要转换整帧 */
+};
+
+/* 控制器型号,作为ssd1306_variants[]的下标,也是i2c/spi设备id表中的driver_data */
+enum ssd1306_type
+{
+    SSD1306_TYPE_SSD1306,
+    SSD1306_TYPE_SSD1309,
+    SSD1306_TYPE_SH1106,
+    SSD1306_TYPE_SSD1322,
+};
+
+/* 
+ * 控制器描述:分辨率,像素格式,地址方式和默认的初始化序列都由它决定,
+ * 转换和开窗口按控制器各实现一份,驱动的其余部分与型号无关
+ */
+struct ssd1306_variant
+{
+    const char *name;
+    u16 width;                          /* 可见区域的分辨率 */
+    u16 height;
+    u8 bpp;                             /* 1:一个字节对应纵向8个点;4:16级灰度,一个字节对应横向2个点 */
+    u8 col_offset;                      /* 可见区域在控制器RAM中的起始列,SSD1322以4个点为一列 */
+    bool page_addressing;               /* 只有页地址模式,一个窗口不能跨页 */
+    bool args_as_data;                  /* 命令的参数要按数据发送(D/C为高),命令序列按{命令,参数个数,参数...}编码 */
+    bool hw_scroll;                     /* 支持0x26~0x2f的硬件滚动命令 */
+    const u8 *init_seq;                 /* 默认的初始化序列 */
+    int init_seq_len;
+    const u8 *flip_seq;                 /* 旋转180度时在初始化序列之后发送,反转列地址和COM扫描方向;为NULL时不支持 */
+    int flip_seq_len;
+    /* 把显存中第page页(8行)[col_start,col_end)列转换成控制器的格式,out为该页在发送缓冲区中的位置 */
+    void (*convert_page)(struct ssd1306_dev *ssd1306,const u8 *smem_base,int page,
+                         int col_start,int col_end,u8 *out);
+    /* 生成开[page_start,page_end]页,[col_start,col_end)列窗口的命令,返回命令的字节数 */
+    int (*window_cmd)(struct ssd1306_dev *ssd1306,int page_start,int page_end,
+                      int col_start,int col_end,u8 *cmd);
+    /* 生成设置起始行的命令,返回命令的字节数;为NULL时不支持ywrap */
+    int (*start_line_cmd)(u8 line,u8 *cmd);
+};
+
+extern const struct ssd1306_variant ssd1306_variants[];
+
+/* 
+ * 脏区信息,以页(8行)为单位记录,每页再记录一个脏列范围[col_start,col_end),
+ * 刷新时只把脏的部分开窗口后发送出去
+ */
+struct ssd1306_damage
+{
+    u8 pages;                           /* 脏页位图,第n位对应第n页 */
+    u16 col_start[SSD_MAX_PAGES];
+    u16 col_end[SSD_MAX_PAGES];
+};
+
+/* 每块屏一个,跟在fb_info后面由framebuffer_alloc一起分配,info->par指向它 */
+struct ssd1306_dev
+{
+    struct fb_info *info;
+    struct device *dev;
+    const struct ssd1306_ops *ops;
+    const struct ssd1306_variant *variant;
+    int page_bytes;                     /* 转换后一页(8行)的字节数 */
+
+    /* 总线相关 */
+    struct i2c_client *client;
+    u16 addr;                           /* i2c:probe时探测到的实际地址 */
+    u16 i2c_max_write;                  /* i2c:适配器一条消息最多写的字节数,0表示没有限制 */
+    u16 i2c_max_msgs;                   /* i2c:一次传输最多的消息数,0表示没有限制 */
+    bool i2c_single_write;              /* i2c:开窗口的命令和数据合成一条消息,用Co位区分命令和数据 */
+    u8 *i2c_stage;                      /* i2c:分块发送时的暂存区 */
+    struct i2c_msg *i2c_msgs;
+    struct spi_device *spi;
+    struct gpio_desc *dc_gpio;          /* spi:D/C脚,低为命令,高为数据 */
+    struct gpio_desc *reset_gpio;       /* spi:复位脚,可以没有 */
+
+    const u8 *init_seq;                 /* 初始化序列 */
+    int init_seq_len;
+    void *video_mem;                    /* 显存,vmalloc分配 */
+    struct fb_deferred_io defio;        /* 映射后靠缺页来跟踪哪些页被写过 */
+    struct fb_ops fbops;                /* 每块屏一份,fb_deferred_io会改写其中的fb_mmap */
+    struct delayed_work work;
+    struct workqueue_struct *wqueue;
+    spinlock_t lock;                    /* 保护damage,fbcon会在原子上下文中标记脏区 */
+    seqcount_t smem_seq;                /* 内核中修改显存(write,fbcon)时持有lock并进入写区间,刷新转换时据此检查 */
+    struct mutex write_lock;            /* 保护write_buf */
+    u8 *write_buf;                      /* write先拷贝到这里,再在写区间中拷贝到显存,copy_from_user不能持有lock */
+    struct ssd1306_damage damage;
+    u8 *shadow;                         /* oled显存(GDDRAM)中当前内容的副本 */
+
+    /* 
+     * 控制台文字的快速路径,只用于单色屏:native是显存的页格式副本,
+     * native_valid的每一位对应一页中的8列,置位表示这些列在native中是最新的,
+     * 刷新时直接拷贝;其他途径修改显存时清掉对应的位.都由lock保护
+     */
+    u8 *native;
+    u32 native_valid[SSD_MAX_PAGES];
+    struct ssd1306_glyph *glyphs;
+
+    /* 
+     * 发送缓冲区,kmalloc分配的,可以直接交给总线控制器做DMA;
+     * tx_buf前SSD_FRAME_HEADROOM个字节留给控制字节和开窗口的命令,之后是转换好的整帧数据,
+     * 转换直接写到这里,发送时不用再拷贝
+     */
+    struct mutex io_lock;               /* 保护下面两个缓冲区以及一次完整的命令+数据序列 */
+    u8 *tx_buf;
+    u8 *frame;                          /* tx_buf + SSD_FRAME_HEADROOM */
+    u8 *cmd_buf;
+    unsigned long frames_flushed;       /* 实际发送出去的帧数 */
+    unsigned long frames_skipped;       /* 与影子相比没有变化而省掉的帧数 */
+    struct ssd1306_stats stats;
+    struct dentry *debugfs;
+    bool page_major;                    /* 显存是否直接采用oled的页格式 */
+    bool gray8;                         /* 单色屏使用8位灰度的显存,转换时抖动 */
+    u8 dither;                          /* enum ssd1306_dither */
+    s16 *dither_err;                    /* 误差扩散用的两行误差,由io_lock保护 */
+    bool tile_member;                   /* 拼接屏中的一块,不单独注册framebuffer */
+    struct device *tile_owner;          /* 占用这块屏的拼接屏,由ssd1306_list_lock保护 */
+    struct list_head node;              /* 挂在ssd1306_list上 */
+    u16 rotate;                         /* 显存相对于屏顺时针旋转的角度,0/90/180/270 */
+    bool sync_write;                    /* write是否等到刷新完成才返回 */
+    int open_count;                     /* 打开的次数,fb_open/fb_release由info->lock串行化 */
+    bool manual_commit;                 /* 映射的显存被写过后不自动刷新,等SSD1306_IOC_FLUSH提交 */
+    bool fair_bus;                      /* 每页单独一次传输,i2c上还限制每次传输的长度,传输之间让出总线 */
+    unsigned int bus_budget_us;         /* 一次刷新最多占用总线的时间,0表示不限制 */
+    bool scrolling;                     /* 硬件滚动是否在进行 */
+    bool shadow_stale;                  /* 屏上的内容被硬件滚动改过了,影子不再可信 */
+    bool removed;                       /* 已经remove,devm的缓冲区和总线都不能再用,由lock保护 */
+    u8 start_line;                      /* pan_display要求的起始行,由lock保护 */
+    u8 hw_start_line;                   /* 屏上当前的起始行 */
+
+    /* 刷新调度,时间均为ktime_get_ns()的值 */
+    unsigned int target_fps;            /* 最高刷新率 */
+    unsigned int backoff;               /* 内容不变时刷新间隔的放大倍数 */
+    u64 last_start;                     /* 上一次刷新开始的时间 */
+    u64 last_xfer_end;                  /* 上一次真正发送数据结束的时间 */
+    u64 last_xfer_ns;                   /* 上一次发送数据花的时间 */
+    u64 fps_window_start;               /* 统计实际帧率的时间窗口 */
+    unsigned int fps_window_frames;
+    unsigned int achieved_fps;
+
+    /* 刷新栅栏:fence_req由lock保护,每次刷新开始时记下当时的值,结束后写入fence_done */
+    u32 fence_req;
+    u32 fence_done;
+    wait_queue_head_t fence_wait;
+};
+
+struct ssd1306_dev *ssd1306_core_alloc(struct device *dev,const struct ssd1306_ops *ops,
+                                      const struct ssd1306_variant *variant);
+int ssd1306_core_probe(struct ssd1306_dev *ssd1306);
+int ssd1306_core_remove(struct ssd1306_dev *ssd1306);
+int ssd1306_dev_init(struct ssd1306_dev *ssd1306);
+int ssd1306_core_claim(struct device_node *np,struct device *owner,struct ssd1306_dev **out);
+void ssd1306_core_unclaim(struct ssd1306_dev *ssd1306);
+void ssd1306_core_blit(struct ssd1306_dev *ssd1306,const u8 *src,u32 pitch,
+                       u32 x,u32 y,u32 width,u32 height);
+u32 ssd1306_fence_begin(struct ssd1306_dev *ssd1306);
+int ssd1306_fence_wait(struct ssd1306_dev *ssd1306,u32 fence,u64 *stamp);
+
+int ssd1306_i2c_register(void);
+void ssd1306_i2c_unregister(void);
+#if IS_ENABLED(CONFIG_SPI_MASTER)
+int ssd1306_spi_register(void);
+void ssd1306_spi_unregister(void);
+#else
+static inline int ssd1306_spi_register(void) { return 0; }
+static inline void ssd1306_spi_unregister(void) {}
+#endif
+int ssd1306_tiled_register(void);
+void ssd1306_tiled_unregister(void);
+void ssd1306_tiled_rescan(void);
+#endif // __KERNEL__
 
 
 
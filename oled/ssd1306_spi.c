@@ -0,0 +1,153 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/spi/spi.h>
+#include <linux/of_device.h>
+#include <linux/gpio/consumer.h>
+#include <linux/delay.h>
+#include <linux/errno.h>
+#include <linux/fb.h>
+
+#include "ssd1306_oled.h"
+
+/*
+ * 4线spi:D/C脚为低时发送的是命令,为高时是数据,不需要控制字节;
+ * spi_write内部用的是spi_sync,缓冲区是kmalloc分配的,控制器可以直接做DMA
+ */
+static int ssd1306_spi_write(struct ssd1306_dev *ssd1306,int dc,u8 *buf,int len)
+{
+    gpiod_set_value_cansleep(ssd1306->dc_gpio,dc);
+    return spi_write(ssd1306->spi,buf,len);
+}
+
+static int ssd1306_spi_write_cmd(struct ssd1306_dev *ssd1306,u8 *buf,int len)
+{
+    return ssd1306_spi_write(ssd1306,0,buf,len);
+}
+
+static int ssd1306_spi_write_data(struct ssd1306_dev *ssd1306,u8 *buf,int len)
+{
+    return ssd1306_spi_write(ssd1306,1,buf,len);
+}
+
+/* 有复位脚时先复位一下,手册要求复位脉冲至少3us */
+static int ssd1306_spi_hw_init(struct ssd1306_dev *ssd1306)
+{
+    if(ssd1306->reset_gpio){
+        gpiod_set_value_cansleep(ssd1306->reset_gpio,1);
+        usleep_range(10,20);
+        gpiod_set_value_cansleep(ssd1306->reset_gpio,0);
+        usleep_range(10,20);
+    }
+    return ssd1306_dev_init(ssd1306);
+}
+
+static const struct ssd1306_ops ssd1306_spi_ops = {
+    .hw_init        = ssd1306_spi_hw_init,
+    .write_cmd      = ssd1306_spi_write_cmd,
+    .write_data     = ssd1306_spi_write_data,
+};
+
+static const struct of_device_id ssd1306_spi_of_match_table[] = {
+    {
+        .compatible = "ssd1306",
+        .data = &ssd1306_variants[SSD1306_TYPE_SSD1306],
+    },
+    {
+        .compatible = "ssd1309",
+        .data = &ssd1306_variants[SSD1306_TYPE_SSD1309],
+    },
+    {
+        .compatible = "sh1106",
+        .data = &ssd1306_variants[SSD1306_TYPE_SH1106],
+    },
+    {
+        .compatible = "ssd1322",
+        .data = &ssd1306_variants[SSD1306_TYPE_SSD1322],
+    },
+    {}
+};
+
+static int ssd1306_spi_probe(struct spi_device *spi)
+{
+    const struct ssd1306_variant *variant = &ssd1306_variants[SSD1306_TYPE_SSD1306];
+    const struct spi_device_id *id = spi_get_device_id(spi);
+    const struct of_device_id *match;
+    struct ssd1306_dev *ssd1306;
+    struct gpio_desc *dc,*reset;
+    int ret;
+
+    /* 设备树匹配时以compatible为准 */
+    match = of_match_device(ssd1306_spi_of_match_table,&spi->dev);
+    if(match)
+        variant = match->data;
+    else if(id)
+        variant = &ssd1306_variants[id->driver_data];
+
+    /* 设备树中用dc-gpios和reset-gpios给出这两个脚,复位脚可以不接 */
+    dc = devm_gpiod_get(&spi->dev,"dc",GPIOD_OUT_LOW);
+    if(IS_ERR(dc)){
+        dev_err(&spi->dev,"get dc gpio failed!\n");
+        return PTR_ERR(dc);
+    }
+    reset = devm_gpiod_get_optional(&spi->dev,"reset",GPIOD_OUT_LOW);
+    if(IS_ERR(reset))
+        return PTR_ERR(reset);
+
+    spi->bits_per_word = 8;
+    ret = spi_setup(spi);
+    if(ret)
+        return ret;
+
+    ssd1306 = ssd1306_core_alloc(&spi->dev,&ssd1306_spi_ops,variant);
+    if(!ssd1306)
+        return -ENOMEM;
+    ssd1306->spi = spi;
+    ssd1306->dc_gpio = dc;
+    ssd1306->reset_gpio = reset;
+    spi_set_drvdata(spi,ssd1306);
+
+    ret = ssd1306_core_probe(ssd1306);
+    if(ret)
+        return ret;
+
+    /* 拼接屏的成员没有注册framebuffer,没有fb编号 */
+    if(ssd1306->tile_member)
+        dev_info(&spi->dev,"tile member: %s at %u Hz\n",variant->name,spi->max_speed_hz);
+    else
+        dev_info(&spi->dev,"fb%d: %s at %u Hz\n",ssd1306->info->node,variant->name,spi->max_speed_hz);
+    return 0;
+}
+
+static int ssd1306_spi_remove(struct spi_device *spi)
+{
+    return ssd1306_core_remove(spi_get_drvdata(spi));
+}
+
+static const struct spi_device_id ssd1306_spi_id_table[] = {
+    {"ssd1306",SSD1306_TYPE_SSD1306},
+    {"ssd1309",SSD1306_TYPE_SSD1309},
+    {"sh1106",SSD1306_TYPE_SH1106},
+    {"ssd1322",SSD1306_TYPE_SSD1322},
+    {}
+};
+
+static struct spi_driver ssd1306_spi_driver = {
+    .driver = {
+        .name = "ssd1306_spi_driver",
+        .of_match_table = ssd1306_spi_of_match_table,
+        .owner = THIS_MODULE,
+    },
+    .probe = ssd1306_spi_probe,
+    .remove = ssd1306_spi_remove,
+    .id_table = ssd1306_spi_id_table,
+};
+
+int ssd1306_spi_register(void)
+{
+    return spi_register_driver(&ssd1306_spi_driver);
+}
+
+void ssd1306_spi_unregister(void)
+{
+    spi_unregister_driver(&ssd1306_spi_driver);
+}
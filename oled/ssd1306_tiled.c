@@ -0,0 +1,444 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/of.h>
+#include <linux/errno.h>
+#include <linux/fb.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <asm/uaccess.h>
+
+#include "ssd1306_oled.h"
+
+/*
+ * 拼接屏:多块相同的屏按columns列拼成一个大的framebuffer,设备树中这样描述:
+ *
+ *     oled_wall {
+ *         compatible = "ssd1306-tiled";
+ *         panels = <&oled0 &oled1 &oled2 &oled3>;   按行排列,从左上角开始
+ *         columns = <2>;
+ *     };
+ *
+ * 成员屏由i2c/spi驱动照常probe,节点中加上tile-member就不再单独注册framebuffer.
+ * 大显存被修改后按块切开,只把改到的部分拷贝到对应成员屏的显存中,
+ * 由成员屏自己的工作队列转换,比较影子并发送;不同总线上的屏各自刷新,互不等待.
+ * 成员屏被占用,移除任何一块成员屏都会先解除拼接屏的绑定;解除绑定不会把拼接屏放到推迟probe的
+ * 列表中,所以成员屏probe成功后由ssd1306_tiled_rescan安排重新匹配,成员都回来后拼接屏重新probe.
+ * 拼接屏的节点要放在根节点下:移除i2c适配器时持有的是它所在总线节点的设备锁,
+ * 解除绑定要锁拼接屏的父设备,两者不能是同一个
+ */
+struct ssd1306_tiled {
+    struct fb_info *info;
+    struct device *dev;
+    struct ssd1306_dev **panels;
+    u32 *fences;                        /* SSD1306_IOC_FLUSH用,ioctl由info->lock串行化 */
+    int num;
+    int columns;
+    int rows;
+    u32 tile_w;                         /* 一块屏的宽和高,单位为点 */
+    u32 tile_h;
+    void *video_mem;
+    struct fb_deferred_io defio;
+    struct fb_ops fbops;                /* 从模板拷贝,fb_deferred_io会改写其中的fb_mmap */
+    bool removed;                       /* 成员已经放开,映射的页不再分发,由defio.lock保护 */
+};
+
+/* 把大显存中的一块矩形分发到它覆盖的各块屏上,可以在原子上下文中调用 */
+static void ssd1306_tiled_damage(struct ssd1306_tiled *tiled,u32 x,u32 y,u32 width,u32 height)
+{
+    struct fb_info *info = tiled->info;
+    u32 pitch = info->fix.line_length;
+    u32 bpp = info->var.bits_per_pixel;
+    u32 x_end,y_end,tx,ty,x0,x1,y0,y1;
+    int col,row;
+
+    if(x >= info->var.xres || y >= info->var.yres || !width || !height)
+        return;
+    x_end = min(x + width,info->var.xres);
+    y_end = min(y + height,info->var.yres);
+
+    for(row = y / tiled->tile_h ; row * tiled->tile_h < y_end ; row++){
+        ty = row * tiled->tile_h;
+        y0 = max(y,ty);
+        y1 = min(y_end,ty + tiled->tile_h);
+        for(col = x / tiled->tile_w ; col * tiled->tile_w < x_end ; col++){
+            tx = col * tiled->tile_w;
+            x0 = max(x,tx);
+            x1 = min(x_end,tx + tiled->tile_w);
+            ssd1306_core_blit(tiled->panels[row * tiled->columns + col],
+                              (u8 *)tiled->video_mem + y0 * pitch + x0 * bpp / 8,pitch,
+                              x0 - tx,y0 - ty,x1 - x0,y1 - y0);
+        }
+    }
+}
+
+/* 按字节范围标记,换算成整行 */
+static void ssd1306_tiled_damage_bytes(struct ssd1306_tiled *tiled,unsigned long offset,unsigned long len)
+{
+    struct fb_info *info = tiled->info;
+    u32 line_start,line_end;
+
+    if(!len)
+        return;
+    line_start = offset / info->fix.line_length;
+    line_end = (offset + len - 1) / info->fix.line_length;
+    ssd1306_tiled_damage(tiled,0,line_start,info->var.xres,line_end - line_start + 1);
+}
+
+static void ssd1306_tiled_deferred_io(struct fb_info *info,struct list_head *pagelist)
+{
+    struct ssd1306_tiled *tiled = info->par;
+    unsigned long offset;
+    struct page *page;
+
+    /* remove之后映射还可能在,写过的页由fb_deferred_io持有defio.lock调用到这里 */
+    if(tiled->removed)
+        return;
+    list_for_each_entry(page,pagelist,lru){
+        offset = page->index << PAGE_SHIFT;
+        if(offset >= info->screen_size)
+            continue;
+        ssd1306_tiled_damage_bytes(tiled,offset,min(PAGE_SIZE,info->screen_size - offset));
+    }
+}
+
+/*
+ * 大显存本身没有写区间保护,并发写入时成员屏可能拿到一半的内容,
+ * 但每次写完都会重新分发,屏上最终是完整的
+ */
+static ssize_t ssd1306_tiled_write(struct fb_info *info,const char __user *buf,size_t count,loff_t *ppos)
+{
+    struct ssd1306_tiled *tiled = info->par;
+    unsigned long p = *ppos;
+    unsigned long total_size = info->screen_size;
+    int err = 0;
+
+    if(info->state != FBINFO_STATE_RUNNING)
+        return -EPERM;
+    if(p > total_size)
+        return -EFBIG;
+    if(count > total_size){
+        err = -EFBIG;
+        count = total_size;
+    }
+    if(count + p > total_size){
+        if(!err)
+            err = -ENOSPC;
+        count = total_size - p;
+    }
+
+    if(copy_from_user((u8 *)tiled->video_mem + p,buf,count))
+        return -EFAULT;
+    *ppos += count;
+    ssd1306_tiled_damage_bytes(tiled,p,count);
+
+    return count ? count : err;
+}
+
+static void ssd1306_tiled_fillrect(struct fb_info *info,const struct fb_fillrect *rect)
+{
+    cfb_fillrect(info,rect);
+    ssd1306_tiled_damage(info->par,rect->dx,rect->dy,rect->width,rect->height);
+}
+
+static void ssd1306_tiled_copyarea(struct fb_info *info,const struct fb_copyarea *area)
+{
+    cfb_copyarea(info,area);
+    ssd1306_tiled_damage(info->par,area->dx,area->dy,area->width,area->height);
+}
+
+static void ssd1306_tiled_imageblit(struct fb_info *info,const struct fb_image *image)
+{
+    cfb_imageblit(info,image);
+    ssd1306_tiled_damage(info->par,image->dx,image->dy,image->width,image->height);
+}
+
+static int ssd1306_tiled_check_var(struct fb_var_screeninfo *var,struct fb_info *info)
+{
+    /* 分辨率和格式由成员屏决定,不能修改 */
+    *var = info->var;
+    return 0;
+}
+
+/* 先让所有的屏都开始刷新再逐个等待,总时间取决于最慢的一条总线;返回最晚的完成时间 */
+static int ssd1306_tiled_flush(struct ssd1306_tiled *tiled,u64 *stamp)
+{
+    u32 *fences = tiled->fences;
+    u64 t;
+    int i,ret;
+
+    flush_delayed_work(&tiled->info->deferred_work);
+    for(i = 0 ; i < tiled->num ; i++)
+        fences[i] = ssd1306_fence_begin(tiled->panels[i]);
+
+    *stamp = 0;
+    for(i = 0 ; i < tiled->num ; i++){
+        ret = ssd1306_fence_wait(tiled->panels[i],fences[i],&t);
+        if(ret)
+            return ret;
+        *stamp = max(*stamp,t);
+    }
+    return 0;
+}
+
+static int ssd1306_tiled_ioctl(struct fb_info *info,unsigned int cmd,unsigned long arg)
+{
+    u64 stamp;
+    int ret;
+
+    switch(cmd){
+        case SSD1306_IOC_FLUSH:
+            ret = ssd1306_tiled_flush(info->par,&stamp);
+            if(ret)
+                return ret;
+            if(copy_to_user((void __user *)arg,&stamp,sizeof(stamp)))
+                return -EFAULT;
+            return 0;
+        default:
+            break;
+    }
+    return -ENOTTY;
+}
+
+/* 最后一个用户关闭后由fb核心调用,fb可能比remove活得久 */
+static void ssd1306_tiled_fb_destroy(struct fb_info *info)
+{
+    struct ssd1306_tiled *tiled = info->par;
+
+    fb_deferred_io_cleanup(info);
+    vfree(tiled->video_mem);
+    framebuffer_release(info);
+}
+
+static const struct fb_ops ssd1306_tiled_fbops = {
+    .owner          = THIS_MODULE,
+    .fb_destroy     = ssd1306_tiled_fb_destroy,
+    .fb_check_var   = ssd1306_tiled_check_var,
+    .fb_write       = ssd1306_tiled_write,
+    .fb_ioctl       = ssd1306_tiled_ioctl,
+    .fb_fillrect    = ssd1306_tiled_fillrect,
+    .fb_copyarea    = ssd1306_tiled_copyarea,
+    .fb_imageblit   = ssd1306_tiled_imageblit,
+};
+
+/* 不用ssd1306_tiled,remove中注销之后它可能已经随fb_info释放了 */
+static void ssd1306_tiled_put_panels(struct ssd1306_dev **panels,int num)
+{
+    int i;
+
+    for(i = 0 ; i < num ; i++){
+        if(panels[i])
+            ssd1306_core_unclaim(panels[i]);
+        panels[i] = NULL;
+    }
+}
+
+/*
+ * 成员屏必须都已经probe完成,否则推迟;所有成员的大小和色深要相同,
+ * 而且不能是页格式,块的边界才能落在大显存的字节上.
+ * 失败时已经占用的成员由调用者用ssd1306_tiled_put_panels放开
+ */
+static int ssd1306_tiled_get_panels(struct ssd1306_tiled *tiled)
+{
+    struct device_node *np = tiled->dev->of_node;
+    struct device_node *panel_np;
+    struct ssd1306_dev *ssd1306;
+    struct fb_var_screeninfo *var;
+    int i,ret;
+
+    for(i = 0 ; i < tiled->num ; i++){
+        panel_np = of_parse_phandle(np,"panels",i);
+        if(!panel_np)
+            return -EINVAL;
+        ret = ssd1306_core_claim(panel_np,tiled->dev,&ssd1306);
+        of_node_put(panel_np);
+        if(ret){
+            if(ret == -EBUSY)
+                dev_err(tiled->dev,"panel %d is already used by another tiled device!\n",i);
+            return ret;
+        }
+        tiled->panels[i] = ssd1306;
+
+        var = &ssd1306->info->var;
+        if(ssd1306->page_major){
+            dev_err(tiled->dev,"panel %d uses page-major format!\n",i);
+            return -EINVAL;
+        }
+        if(i && (var->xres != tiled->tile_w || var->yres != tiled->tile_h ||
+                 var->bits_per_pixel != tiled->info->var.bits_per_pixel)){
+            dev_err(tiled->dev,"panel %d does not match panel 0!\n",i);
+            return -EINVAL;
+        }
+        tiled->tile_w = var->xres;
+        tiled->tile_h = var->yres;
+        tiled->info->var.bits_per_pixel = var->bits_per_pixel;
+    }
+    return 0;
+}
+
+static int ssd1306_tiled_probe(struct platform_device *pdev)
+{
+    struct device *dev = &pdev->dev;
+    struct ssd1306_tiled *tiled;
+    struct ssd1306_dev *panel0;
+    struct fb_info *info;
+    u32 columns = 1,fps = SSD_DEFAULT_FPS;
+    u32 screen_size;
+    int num,ret;
+
+    num = of_count_phandle_with_args(dev->of_node,"panels",NULL);
+    of_property_read_u32(dev->of_node,"columns",&columns);
+    if(num <= 0 || !columns || num % columns){
+        dev_err(dev,"%d panels can not be arranged in %u columns!\n",num,columns);
+        return -EINVAL;
+    }
+
+    info = framebuffer_alloc(sizeof(struct ssd1306_tiled),dev);
+    if(!info)
+        return -ENOMEM;
+    tiled = info->par;
+    tiled->info = info;
+    tiled->dev = dev;
+    tiled->num = num;
+    tiled->columns = columns;
+    tiled->rows = num / columns;
+
+    ret = -ENOMEM;
+    tiled->panels = devm_kcalloc(dev,num,sizeof(*tiled->panels),GFP_KERNEL);
+    tiled->fences = devm_kcalloc(dev,num,sizeof(*tiled->fences),GFP_KERNEL);
+    if(!tiled->panels || !tiled->fences)
+        goto err_release;
+    ret = ssd1306_tiled_get_panels(tiled);
+    if(ret)
+        goto err_put;
+    panel0 = tiled->panels[0];
+
+    /* 大显存是行格式,成员屏的格式(单色或灰度)和它一样 */
+    info->var.xres = info->var.xres_virtual = tiled->tile_w * tiled->columns;
+    info->var.yres = info->var.yres_virtual = tiled->tile_h * tiled->rows;
+    info->var.red = panel0->info->var.red;
+    info->var.green = panel0->info->var.green;
+    info->var.blue = panel0->info->var.blue;
+    info->var.grayscale = panel0->info->var.grayscale;
+    info->var.activate = FB_ACTIVATE_NXTOPEN;
+    info->var.vmode = FB_VMODE_NONINTERLACED;
+    info->fix = panel0->info->fix;
+    strcpy(info->fix.id,"my oled tiled");
+    info->fix.ywrapstep = 0;
+    info->fix.line_length = info->var.xres * info->var.bits_per_pixel / 8;
+    screen_size = info->fix.line_length * info->var.yres;
+
+    ret = -ENOMEM;
+    tiled->video_mem = vzalloc(PAGE_ALIGN(screen_size));
+    if(!tiled->video_mem)
+        goto err_put;
+    info->fix.smem_start = (unsigned long)tiled->video_mem;
+    info->fix.smem_len = PAGE_ALIGN(screen_size);
+    info->screen_base = (void *__iomem)tiled->video_mem;
+    info->screen_size = screen_size;
+    tiled->fbops = ssd1306_tiled_fbops;
+    info->fbops = &tiled->fbops;
+    info->flags = FBINFO_DEFAULT | FBINFO_VIRTFB;
+
+    /* 成员屏按自己的刷新率攒帧,这里的延迟只决定多久收集一次映射后写过的页 */
+    of_property_read_u32(dev->of_node,"max-fps",&fps);
+    fps = clamp_t(u32,fps,1,1000);
+    tiled->defio.delay = msecs_to_jiffies(MSEC_PER_SEC / fps) ? : 1;
+    tiled->defio.deferred_io = ssd1306_tiled_deferred_io;
+    info->fbdefio = &tiled->defio;
+    fb_deferred_io_init(info);
+
+    ret = register_framebuffer(info);
+    if(ret < 0)
+        goto err_defio;
+    platform_set_drvdata(pdev,tiled);
+
+    dev_info(dev,"fb%d: %dx%d panels,%ux%u\n",info->node,tiled->columns,tiled->rows,
+             info->var.xres,info->var.yres);
+    return 0;
+err_defio:
+    fb_deferred_io_cleanup(info);
+    vfree(tiled->video_mem);
+err_put:
+    ssd1306_tiled_put_panels(tiled->panels,tiled->num);
+err_release:
+    framebuffer_release(info);
+    return ret;
+}
+
+/* 
+ * 成员屏的刷新由它们自己在remove时收尾.先把还没处理的映射页分发给成员屏,成员屏这时还在;
+ * fb_deferred_io_cleanup只会取消,不会分发.之后映射的页不再分发,注销后放开成员.
+ * fb可能还被打开或者映射着,显存和fb_info在ssd1306_tiled_fb_destroy中释放,
+ * 没有人打开时注销过程中就会调用,所以成员数组要先取出来
+ */
+static int ssd1306_tiled_remove(struct platform_device *pdev)
+{
+    struct ssd1306_tiled *tiled = platform_get_drvdata(pdev);
+    struct fb_info *info = tiled->info;
+    struct ssd1306_dev **panels = tiled->panels;
+    int num = tiled->num;
+
+    flush_delayed_work(&info->deferred_work);
+    mutex_lock(&tiled->defio.lock);
+    tiled->removed = true;
+    mutex_unlock(&tiled->defio.lock);
+
+    unregister_framebuffer(info);
+    ssd1306_tiled_put_panels(panels,num);
+    return 0;
+}
+
+static const struct of_device_id ssd1306_tiled_of_match_table[] = {
+    {.compatible = "ssd1306-tiled"},
+    {}
+};
+
+static struct platform_driver ssd1306_tiled_driver = {
+    .driver = {
+        .name = "ssd1306_tiled_driver",
+        .of_match_table = ssd1306_tiled_of_match_table,
+        .owner = THIS_MODULE,
+    },
+    .probe = ssd1306_tiled_probe,
+    .remove = ssd1306_tiled_remove,
+};
+
+/* 
+ * 重新匹配要放到工作队列中:成员屏probe时可能持有i2c控制器及其父设备的锁,
+ * 直接调用driver_attach去锁拼接屏的父设备可能死锁
+ */
+static bool ssd1306_tiled_registered;
+
+static void ssd1306_tiled_rescan_func(struct work_struct *work)
+{
+    if(driver_attach(&ssd1306_tiled_driver.driver))
+        pr_warn("ssd1306: rescan tiled devices failed!\n");
+}
+static DECLARE_WORK(ssd1306_tiled_rescan_work,ssd1306_tiled_rescan_func);
+
+/* 成员屏probe成功后调用,等着它的拼接屏可以重新probe了 */
+void ssd1306_tiled_rescan(void)
+{
+    if(ssd1306_tiled_registered)
+        schedule_work(&ssd1306_tiled_rescan_work);
+}
+
+int ssd1306_tiled_register(void)
+{
+    int ret;
+
+    ret = platform_driver_register(&ssd1306_tiled_driver);
+    if(!ret)
+        ssd1306_tiled_registered = true;
+    return ret;
+}
+
+void ssd1306_tiled_unregister(void)
+{
+    ssd1306_tiled_registered = false;
+    cancel_work_sync(&ssd1306_tiled_rescan_work);
+    platform_driver_unregister(&ssd1306_tiled_driver);
+}